@@ -0,0 +1,201 @@
+#ifndef AdaptivePlaneRansac_H
+#define AdaptivePlaneRansac_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <pcl/point_cloud.h>
+
+using namespace std;
+
+// RANSAC plane detector for the plane peeling of AutoDetectLaser.
+// - termination: k = log(1 - p) / log(1 - w^3), updated whenever a better inlier ratio w is found
+// - guided sampling (PROSAC style): the points are ranked by their distance to the PCA plane of the set and
+//   the minimal samples are drawn from the best ranked ones first, widening to the whole set within
+//   grow_iter_ hypotheses; the PCA plane itself is the first hypothesis
+// - scoring: BATCH hypotheses are counted in one pass over the points (SoA, the inner loop vectorizes)
+// The best plane is refit to its inliers by least squares and the inliers are selected again,
+// as SACSegmentation with setOptimizeCoefficients(true) does. Inliers are strictly closer than the threshold.
+class AdaptivePlaneRansac
+{
+    public:
+        static const int BATCH = 8;
+
+    private:
+        double threshold_ = 0.01, probability_ = 0.99;
+        int max_iter_ = 1000, grow_iter_ = 64;
+        int iterations_ = 0;
+        vector<float> x_, y_, z_;       // the indexed points, SoA
+        vector<float> quality_;
+        vector<int> rank_, sel_;
+
+        // least-squares plane (normal: smallest PCA axis) of the points at positions sel, or of all if sel is null
+        bool fitPlane(const vector<int>* sel, Eigen::Vector4f& plane) const
+        {
+            const int m = sel ? sel->size() : x_.size();
+            if(m < 3)   return false;
+            Eigen::Vector3d c = Eigen::Vector3d::Zero();
+            for(int k = 0; k < m; k++)
+            {
+                int i = sel ? (*sel)[k] : k;
+                c += Eigen::Vector3d(x_[i], y_[i], z_[i]);
+            }
+            c /= m;
+            Eigen::Matrix3d cov = Eigen::Matrix3d::Zero();
+            for(int k = 0; k < m; k++)
+            {
+                int i = sel ? (*sel)[k] : k;
+                Eigen::Vector3d d(x_[i] - c[0], y_[i] - c[1], z_[i] - c[2]);
+                cov += d * d.transpose();
+            }
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(cov);
+            Eigen::Vector3d nrm = es.eigenvectors().col(0);
+            if(!nrm.allFinite())    return false;
+            plane << nrm.cast<float>(), (float)(-nrm.dot(c));
+            return true;
+        }
+        bool planeFromSample(int a, int b, int c, float* plane) const
+        {
+            Eigen::Vector3f pa(x_[a], y_[a], z_[a]), pb(x_[b], y_[b], z_[b]), pc(x_[c], y_[c], z_[c]);
+            Eigen::Vector3f nrm = (pb - pa).cross(pc - pa);
+            float len = nrm.norm();
+            if(len < 1e-9f)     return false;   // collinear
+            nrm /= len;
+            plane[0] = nrm[0];  plane[1] = nrm[1];  plane[2] = nrm[2];
+            plane[3] = -nrm.dot(pa);
+            return true;
+        }
+        void select(const Eigen::Vector4f& plane, vector<int>& pos) const
+        {
+            pos.clear();
+            const float thre = threshold_;
+            for(int i = 0; i < (int)x_.size(); i++)
+            {
+                if(fabs(plane[0] * x_[i] + plane[1] * y_[i] + plane[2] * z_[i] + plane[3]) < thre)
+                    pos.push_back(i);
+            }
+        }
+
+    public:
+        AdaptivePlaneRansac(){};
+        ~AdaptivePlaneRansac(){};
+
+        void setDistanceThreshold(double thre) { threshold_ = thre; }
+        void setMaxIterations(int n) { max_iter_ = n; }
+        void setProbability(double p) { probability_ = p; }
+        // hypotheses after which the samples come from the whole set
+        void setGrowIterations(int n) { grow_iter_ = max(1, n); }
+        int iterations() const { return iterations_; }
+
+        // Dominant plane among cloud[indices]. inliers gets cloud indices (in indices order), plane (a, b, c, d) with unit normal.
+        template<typename PointT>
+        bool segment(const pcl::PointCloud<PointT>& cloud, const vector<int>& indices, vector<int>& inliers, Eigen::Vector4f& plane)
+        {
+            inliers.clear();
+            iterations_ = 0;
+            const int n = indices.size();
+            if(n < 3)   return false;
+            x_.resize(n);   y_.resize(n);   z_.resize(n);
+            for(int i = 0; i < n; i++)
+            {
+                const PointT& p = cloud.points[indices[i]];
+                x_[i] = p.x;    y_[i] = p.y;    z_[i] = p.z;
+            }
+
+            // ------ rank by distance to the PCA plane ------
+            Eigen::Vector4f pca_plane;
+            if(!fitPlane(nullptr, pca_plane))
+                return false;
+            quality_.resize(n);
+            for(int i = 0; i < n; i++)
+                quality_[i] = fabs(pca_plane[0] * x_[i] + pca_plane[1] * y_[i] + pca_plane[2] * z_[i] + pca_plane[3]);
+            rank_.resize(n);
+            iota(rank_.begin(), rank_.end(), 0);
+            stable_sort(rank_.begin(), rank_.end(), [this](int a, int b) { return quality_[a] < quality_[b]; });
+
+            // ------ hypothesize and verify in batches ------
+            mt19937 rng(12345u);    // fixed seed: the same input gives the same plane
+            const double log_p = log(1.0 - probability_);
+            const float thre = threshold_;
+            float pa[BATCH], pb[BATCH], pc[BATCH], pd[BATCH];
+            int count[BATCH];
+            int best_count = 0, hyp = 0, failed = 0;
+            Eigen::Vector4f best = pca_plane;
+            double k = max_iter_;
+            while(hyp < k && hyp < max_iter_ && failed < max_iter_)
+            {
+                int nb = 0;
+                while(nb < BATCH && hyp + nb < max_iter_ && failed < max_iter_)
+                {
+                    float h[4];
+                    if(hyp + nb == 0)
+                    {
+                        h[0] = pca_plane[0];  h[1] = pca_plane[1];  h[2] = pca_plane[2];  h[3] = pca_plane[3];
+                    }
+                    else
+                    {
+                        int t = hyp + nb;
+                        int m = (t >= grow_iter_) ? n : max(min(n, 3), (int)((long)n * t / grow_iter_));
+                        uniform_int_distribution<int> pick(0, m - 1);
+                        int a = rank_[pick(rng)], b = rank_[pick(rng)], c = rank_[pick(rng)];
+                        if(a == b || a == c || b == c || !planeFromSample(a, b, c, h))
+                        {
+                            failed++;
+                            continue;
+                        }
+                    }
+                    pa[nb] = h[0];  pb[nb] = h[1];  pc[nb] = h[2];  pd[nb] = h[3];
+                    nb++;
+                }
+                if(nb == 0) break;
+                for(int j = nb; j < BATCH; j++)
+                {
+                    pa[j] = pb[j] = pc[j] = 0.0f;
+                    pd[j] = numeric_limits<float>::max();
+                }
+
+                for(int j = 0; j < BATCH; j++)  count[j] = 0;
+                for(int i = 0; i < n; i++)
+                {
+                    const float x = x_[i], y = y_[i], z = z_[i];
+                    for(int j = 0; j < BATCH; j++)
+                        count[j] += fabs(pa[j] * x + pb[j] * y + pc[j] * z + pd[j]) < thre;
+                }
+
+                for(int j = 0; j < nb; j++)
+                {
+                    if(count[j] <= best_count)  continue;
+                    best_count = count[j];
+                    best << pa[j], pb[j], pc[j], pd[j];
+                    double w = (double)best_count / n;
+                    double p_no_outliers = 1.0 - w * w * w;
+                    p_no_outliers = max(numeric_limits<double>::epsilon(), min(1.0 - numeric_limits<double>::epsilon(), p_no_outliers));
+                    k = log_p / log(p_no_outliers);
+                }
+                hyp += nb;
+            }
+            iterations_ = hyp;
+            if(best_count < 3)
+                return false;
+
+            // ------ least-squares refit on the inliers ------
+            select(best, sel_);
+            Eigen::Vector4f refined;
+            if(fitPlane(&sel_, refined))
+            {
+                best = refined;
+                select(best, sel_);
+            }
+            plane = best;
+            inliers.resize(sel_.size());
+            for(size_t i = 0; i < sel_.size(); i++)
+                inliers[i] = indices[sel_[i]];
+            return !inliers.empty();
+        }
+};
+
+#endif
@@ -6,6 +6,8 @@
 #define DEBUG2 0
 // #define STATIC_ANALYSE
 
+#include <cfloat>
+
 #include <pcl/io/pcd_io.h>
 #include <pcl/io/png_io.h>
 #include <pcl/common/common.h>
@@ -21,6 +23,7 @@
 
 #include <pcl/features/integral_image_normal.h>
 #include <pcl/features/normal_3d.h>
+#include <pcl/features/normal_3d_omp.h>
 #include <pcl/visualization/cloud_viewer.h>
 #include <pcl/filters/passthrough.h>
 #include <pcl/filters/project_inliers.h>
@@ -43,6 +46,16 @@
 // #include "estimateBorders.h"
 #include "FourCircleCenters.h"
 #include "EstimateBoundary.h"
+#include "VoxelHash.h"
+#include "ThreadPool.h"
+#include "PlaneSegmentBuffer.h"
+#include "FrameArena.h"
+#include "DistanceField2D.h"
+#include "PlanarRegistration.h"
+#include "StreamingDeviation.h"
+#include "VoxelCluster.h"
+#include "AdaptivePlaneRansac.h"
+#include "RingRangeImage.h"
 
 #ifdef STATIC_ANALYSE
 #include <pcl/visualization/pcl_visualizer.h>
@@ -59,6 +72,23 @@ typedef pcl::PointXYZI PointType_;
 typedef pcl::PointCloud<PointType_> CloudType_;
 
 enum LASER_TYPE { NR_LIDAR = 0, R_LIDAR };
+// intermediate clouds the detector keeps for debug output, see setCaptureMask()
+enum CAPTURE_FLAG
+{
+    CAPTURE_NONE = 0,
+    CAPTURE_X_FILTERED = 1 << 0,
+    CAPTURE_DS_FILTERED = 1 << 1,
+    CAPTURE_GS_FILTERED = 1 << 2,
+    CAPTURE_PCA_REGIST_PC = 1 << 3,
+    CAPTURE_PCA_REGIST_BOUNDARY = 1 << 4,
+    CAPTURE_ICP_REGIST_BOUNDARY = 1 << 5,
+    CAPTURE_PLANE_SEGMENTS = 1 << 6,
+    CAPTURE_ALL = (1 << 7) - 1
+};
+// registration of a PCA-aligned candidate boundary onto the template, see setRegistrationMethod()
+enum REGIST_METHOD { REGIST_ICP = 0, REGIST_PLANAR };
+// Euclidean clustering backend of detectCalibBoard(), see setClusterMethod()
+enum CLUSTER_METHOD { CLUSTER_KDTREE = 0, CLUSTER_VOXEL };
 
 int getRandomNumber();
 template <typename PointT>
@@ -66,6 +96,24 @@ void publishPC(const ros::Publisher& pc_pub_, const std_msgs::Header& header_, t
 
 class AutoDetectLaser: public EstimateBoundary<PointType_>
 {
+    public:
+        // Verification result of one plane candidate.
+        struct BoardCheck
+        {
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+            bool evaluated = false, is_board = false, tr_valid = false;
+            double rmse_ukn2tpl = -1.0, rmse_tpl2ukn = -1.0, icp_score = -1.0;
+            int pca_hypothesis = -1;    // index of the PCA axis hypothesis used, see selectPCAHypothesis()
+            Eigen::Matrix4f Tr_ukn2tpl = Eigen::Matrix4f::Identity();
+            Eigen::Vector4f C_source, C_target;
+            Eigen::Matrix3f U_source, U_target;
+            Eigen::Vector3f lamda_source, lamda_target;
+            CloudType_::Ptr plane, boundary, boundary_registed;
+            pcl::IndicesPtr plane_indices;  // plane as indices of the RG frame cloud (plane[k] = frame[plane_indices[k]]), see useNormalCache()
+            CloudType_::Ptr pca_regist_pc, pca_regist_boundary, icp_regist_boundary;
+        };
+        typedef vector<BoardCheck, Eigen::aligned_allocator<BoardCheck> > BoardCheckList;
+
     private:
         double rmse_ukn2tpl_thre_, rmse_tpl2ukn_thre_;
         bool use_vox_filter_ = true;
@@ -73,6 +121,7 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
         bool use_gauss_filter_ = true;  // for noisy environment
         bool use_i_filter_ = true;
         bool use_statistic_filter_ = false; // for noisy environment
+        bool use_fused_prefilter_ = true;   // x-filter, intensity filter and voxel binning in one pass
 
         double voxel_grid_size_ = 0.01;
         double gauss_k_sigma_ = 4, gauss_k_thre_rt_sigma_ = 4, gauss_k_thre_ = 0.05, gauss_conv_radius_ = 0.05; 
@@ -86,6 +135,79 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
         int RG_neighbor_n_ = 30;
 
         pcl::PointCloud<pcl::PointXYZI>::Ptr calib_template_;
+        // search structures of the template, built once in setCalibTemplate()
+        pcl::KdTreeFLANN<PointType_>::Ptr template_kdtree_;
+        pcl::search::KdTree<PointType_>::Ptr template_search_;     // ICP target tree
+        DistanceField2D<PointType_> template_df_;
+        bool use_template_df_ = true;
+        PlanarRegistration<PointType_> planar_regist_{template_df_};
+        int regist_method_ = REGIST_PLANAR;
+        int planar_polish_iter_ = 0;    // ICP iterations run after the planar registration, 0 = none
+        bool use_pca_hypotheses_ = true;
+        int hyp_score_points_ = 200;    // boundary points used to score one PCA hypothesis
+        bool verify_early_abort_ = true;
+
+        VoxelHashGrid voxel_hash_;  // reused across frames, keeps its buckets
+        static const int PREFILTER_CHUNK = 1024;   // points per fusedPrefilter() chunk
+        vector<float> soa_x_, soa_y_, soa_z_, soa_i_;   // SoA scratch for one prefilter chunk
+        vector<uint8_t> x_keep_, keep_;
+
+        ThreadPool pool_;   // per-cluster plane extraction and board check
+        vector<BoardCheckList> cluster_checks_;
+        vector<FrameArena> arenas_;     // one per pool worker, reset at the start of every frame
+        vector<pcl::PointIndices> cluster_indices_;     // clusters (or RG regions) of the current frame
+        vector<int> region_of_;         // RG region of every point of the organized frame, -1 for none
+        vector<uint8_t> region_colors_;
+        VoxelClusterExtraction voxel_cluster_;
+        int cluster_method_ = CLUSTER_VOXEL;
+        bool use_adaptive_ransac_ = true;
+        bool use_planarity_check_ = true;
+        double board_w_ = 1.2, board_h_ = 0.8;      // calibration board size (m)
+        double board_extent_tol_ = 1.25, planar_inlier_ratio_ = 0.95;
+        enum PLANARITY_CLASS { PLANARITY_AMBIGUOUS = 0, PLANARITY_REJECT, PLANARITY_PLANE };
+        pcl::PointCloud<pcl::Normal>::Ptr rg_normals_;
+        CloudType_::Ptr normal_cloud_;      // the frame cloud rg_normals_ belong to
+        bool use_normal_cache_ = true;
+        bool use_grid_boundary_ = true;
+
+        // tracking mode, see trackCalibBoard()
+        bool use_tracking_ = false, tracking_valid_ = false, warm_start_ = false;
+        double tracking_margin_ = 0.3;      // ROI inflation around the last board (m)
+        Eigen::Vector3f track_min_, track_max_;
+        Eigen::Matrix4f track_Tr_ = Eigen::Matrix4f::Identity();
+        CloudType_::Ptr track_roi_;
+
+        // organized path, see searchCalibBoardOrganized()
+        double ri_range_thre_ = 0.2;    // largest range jump between neighbouring pixels of one cluster (m)
+        int ri_col_window_ = 2;         // azimuth columns searched on each side for a neighbour
+        vector<uint8_t> organized_mask_;
+        RangeImageScratch ri_scratch_;  // buffers of the range image passes, kept from frame to frame
+
+        void resetArenas()
+        {
+            arenas_.resize(pool_.size());
+            for(auto& a : arenas_)
+                a.reset();
+            normal_cloud_.reset();
+        }
+        // the frame normals can stand in for the normals of the plane given by these frame indices
+        bool cachedNormalsValid(const pcl::IndicesPtr& indices) const
+        {
+            if(!indices || !normal_cloud_ || rg_normals_->points.size() != normal_cloud_->points.size())
+                return false;
+            for(int i : *indices)
+            {
+                const pcl::Normal& n = rg_normals_->points[i];
+                if(!isfinite(n.normal_x) || !isfinite(n.normal_y) || !isfinite(n.normal_z))
+                    return false;
+            }
+            return true;
+        }
+
+        PlaneSegmentBuffer plane_segments_; // bounded store behind colored_i_planes_
+        unsigned int capture_mask_ = CAPTURE_ALL;
+
+        bool capture(unsigned int flag) const { return (capture_mask_ & flag) != 0; }
 
     public:
         LASER_TYPE laser_type_ = NR_LIDAR;
@@ -103,7 +225,7 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
 
         // for debug view
         CloudType_::Ptr x_filtered_, ds_filtered_, gs_filtered_, pca_regist_pc_, pca_regist_boundary_, icp_regist_boundary_;
-        pcl::PointCloud<pcl::PointXYZI>::Ptr colored_i_planes_;
+        pcl::PointCloud<pcl::PointXYZI>::Ptr colored_i_planes_;   // planes of the last frame(s), see setPlaneSegmentHistory()
 
         CloudType_::Ptr calib_board_boundary_, calib_board_boundary_registed_;
         pcl::PointCloud<pcl::PointXYZRGB>::Ptr colored_planes_;
@@ -117,18 +239,46 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
             icp_regist_boundary_ = CloudType_::Ptr (new CloudType_);
 
             calib_template_ = CloudType_::Ptr (new CloudType_);
-            colored_i_planes_ = CloudType_::Ptr (new CloudType_);
+            template_kdtree_ = pcl::KdTreeFLANN<PointType_>::Ptr (new pcl::KdTreeFLANN<PointType_>);
+            template_search_ = pcl::search::KdTree<PointType_>::Ptr (new pcl::search::KdTree<PointType_>);
+            colored_i_planes_ = plane_segments_.output();
             calib_board_boundary_ = CloudType_::Ptr (new CloudType_);           
             calib_board_boundary_registed_ = CloudType_::Ptr (new CloudType_);
 
             colored_planes_ = pcl::PointCloud<pcl::PointXYZRGB>::Ptr (new pcl::PointCloud<pcl::PointXYZRGB>);
+            arenas_.resize(pool_.size());
+            rg_normals_ = pcl::PointCloud<pcl::Normal>::Ptr (new pcl::PointCloud<pcl::Normal>);
+            track_roi_ = CloudType_::Ptr (new CloudType_);
         };
         ~AutoDetectLaser(){};
 
         void setCalibTemplate(pcl::PointCloud<pcl::PointXYZI>& template_pc_)
         {
             *calib_template_ = template_pc_;
+            template_kdtree_->setInputCloud(calib_template_);
+            template_search_->setInputCloud(calib_template_);
+            template_df_.build(calib_template_);
+        }
+        // nearest template distances from the precomputed distance field instead of the KD-tree
+        void useTemplateDistanceField(bool flag) { use_template_df_ = flag; }
+        // REGIST_PLANAR: in-plane (x, y, yaw) alignment on the template distance field, optionally
+        // followed by polish_iter full 6-DoF ICP iterations; REGIST_ICP: PCL ICP as before
+        void setRegistrationMethod(int method, int polish_iter = 0)
+        {
+            regist_method_ = method;
+            planar_polish_iter_ = polish_iter;
         }
+        // try all sign/order ambiguities of the PCA axes and refine the best one, instead of the raw eigenvector basis
+        void usePCAHypotheses(bool flag) { use_pca_hypotheses_ = flag; }
+        // stop the template difference as soon as a candidate cannot pass the rmse thresholds any more;
+        // the reported rmse of a rejected candidate is then only a lower bound (turn off to tune the thresholds)
+        void useVerifyEarlyAbort(bool flag) { verify_early_abort_ = flag; }
+        // RG path: the boundary estimation of a candidate reuses the frame normals of the region growing
+        // and works on frame indices, instead of copying the plane and estimating its normals again
+        void useNormalCache(bool flag) { use_normal_cache_ = flag; }
+        // boundary of a candidate on an occupancy grid in its PCA plane (see GridBoundaryEstimation)
+        // instead of the kNN normal and boundary estimation
+        void useGridBoundary(bool flag) { use_grid_boundary_ = flag; }
         void setRemoveRangeX(double min_, double max_)
         {
             remove_x_min_ = min_;
@@ -159,6 +309,37 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
             cluster_size_min_ = cluster_MinSize;
             cluster_size_max_ = cluster_MaxSize;
         }
+        // CLUSTER_VOXEL: voxel hash + union-find, CLUSTER_KDTREE: pcl::EuclideanClusterExtraction; both give the same clusters
+        void setClusterMethod(int method) { cluster_method_ = method; }
+        // plane peeling with AdaptivePlaneRansac (guided sampling, confidence-based stop) instead of pcl::SACSegmentation;
+        // iter_num of setPlaneSegmentationParam stays the upper bound
+        void useAdaptiveRansac(bool flag) { use_adaptive_ransac_ = flag; }
+        // classify each cluster by PCA before the plane peeling: single planes of board size are checked directly,
+        // single planes larger than the board and clusters smaller than it are dropped, the rest is peeled
+        void usePlanarityCheck(bool flag) { use_planarity_check_ = flag; }
+        void setBoardSize(double width, double height)
+        {
+            board_w_ = width;
+            board_h_ = height;
+        }
+        // once a board is found, process only the box around it (inflated by margin) in the next frames and
+        // start the registration from its transform; a miss falls back to the whole scene
+        void useTracking(bool flag)
+        {
+            use_tracking_ = flag;
+            tracking_valid_ = false;
+        }
+        void setTrackingMargin(double margin) { tracking_margin_ = margin; }
+        // forget the tracked board, e.g. after the board was moved
+        void resetTracking() { tracking_valid_ = false; }
+        bool isTracking() const { return use_tracking_ && tracking_valid_; }
+        // clustering of the organized (range image) path: neighbouring pixels whose ranges differ by at most
+        // range_thre are connected, looking up to col_window azimuth columns to each side
+        void setRangeImageClusterParam(double range_thre, int col_window)
+        {
+            ri_range_thre_ = range_thre;
+            ri_col_window_ = col_window;
+        }
         void useStatisticalFilter(bool flag) { use_statistic_filter_ = flag; }
         void setStatisticalFilterParam(int MeanK, int StddevMulThresh)
         {
@@ -172,6 +353,7 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
             Pseg_iter_num_ = seg_MaxIterations;
         }
         void useIntensityFilter(bool flag) { use_i_filter_ = flag; }
+        void useFusedPrefilter(bool flag) { use_fused_prefilter_ = flag; }
         void setIntensityFilterParam(double min_RemoveIntensity, double max_RemoveIntensity)
         {
             i_filter_out_min_ = min_RemoveIntensity;
@@ -182,20 +364,79 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
             RG_curve_thre_ = rg_curve_thre_;
             RG_neighbor_n_ = n_;
         }
+        // keep the plane segments of the last n frames in colored_i_planes_, at most max_points per frame
+        void setPlaneSegmentHistory(int n, size_t max_points = 100000)
+        {
+            plane_segments_.setHistory(n);
+            plane_segments_.setCapacity(max_points);
+            colored_i_planes_ = plane_segments_.output();
+        }
+        // Only the intermediates in mask (CAPTURE_FLAG bits) are kept, the others stay empty.
+        void setCaptureMask(unsigned int mask) { capture_mask_ = mask; }
+        void setNumThreads(int n)
+        {
+            #ifdef STATIC_ANALYSE
+            n = 1;  // the PCL viewers must stay on one thread
+            #endif
+            pool_.resize(n);
+            arenas_.resize(pool_.size());
+        }
 
         bool isCalibBoard(CloudType_::Ptr& cloud, 
                 CloudType_::Ptr& cloud_boundary,
                 CloudType_::Ptr& cloud_boundary_registed);
+        bool checkCalibBoard(CloudType_::Ptr& cloud, BoardCheck& check, FrameArena& arena);
+        void applyBoardCheck(const BoardCheck& check, bool with_clouds = true);
         Eigen::Matrix4f PCARegistration(CloudType_::Ptr& source_cloud, CloudType_::Ptr& target_cloud);
-        float CalculateRMSE(std::vector<float> data);
-        float ComputeDifference(CloudType_::Ptr& source, CloudType_::Ptr& target);
+        Eigen::Matrix4f PCARegistration(CloudType_::Ptr& source_cloud, CloudType_::Ptr& target_cloud, BoardCheck& check);
+        int selectPCAHypothesis(CloudType_::Ptr& boundary, BoardCheck& check, Eigen::Matrix4f& PCA_Transform, FrameArena& arena);
+        float scorePCAHypothesis(const CloudType_& boundary, pcl::search::KdTree<PointType_>& boundary_tree, const Eigen::Matrix4f& TR,
+                                 float& rmse_ukn2tpl, float& rmse_tpl2ukn);
+        // the accept gate on the two template deviations
+        bool passesDifference(float rmse_ukn2tpl, float rmse_tpl2ukn) const
+        {
+            return rmse_ukn2tpl <= rmse_ukn2tpl_thre_ && rmse_tpl2ukn <= rmse_tpl2ukn_thre_;
+        }
+        float CalculateRMSE(const std::vector<float>& data);
+        float ComputeDifference(CloudType_::Ptr& source, CloudType_::Ptr& target, FrameArena& arena);
+        float ComputeDifferenceToTemplate(CloudType_::Ptr& source);
+        float streamDifference(CloudType_::Ptr& source, const pcl::search::KdTree<PointType_>& target_tree, float thre, atomic<bool>& abort);
+        float streamDifferenceToTemplate(CloudType_::Ptr& source, float thre, atomic<bool>& abort);
+        bool verifyDifference(CloudType_::Ptr& cloud, float& rmse_ukn2tpl, float& rmse_tpl2ukn, FrameArena& arena);
         void RemoveFloor(CloudType_::Ptr& cloud_in, CloudType_::Ptr& cloud_out, float part);
         bool detectCalibBoard(CloudType_::Ptr &cloud_in, 
                                         CloudType_::Ptr &calib_board);
+        bool detectCalibBoard(CloudType_::Ptr &cloud_in, const RingRangeImage& image,
+                                        CloudType_::Ptr &calib_board);
         bool detectCalibBoardRG(CloudType_::Ptr &cloud_in, 
                                         CloudType_::Ptr &calib_board);
+        bool detectCalibBoardRG(CloudType_::Ptr &cloud_in, const RingRangeImage& image,
+                                        CloudType_::Ptr &calib_board);
+        bool trackCalibBoard(CloudType_::Ptr &calib_board, const function<bool(bool)>& search);
+        bool searchCalibBoard(CloudType_::Ptr &cloud_in, 
+                                        CloudType_::Ptr &calib_board);
+        bool searchCalibBoardOrganized(CloudType_::Ptr &cloud_in, const RingRangeImage& image,
+                                        CloudType_::Ptr &calib_board, bool in_roi);
+        bool searchCalibBoardRG(CloudType_::Ptr &cloud_in, 
+                                        CloudType_::Ptr &calib_board);
+        bool searchCalibBoardRGOrganized(CloudType_::Ptr &cloud_in, const RingRangeImage& image,
+                                        CloudType_::Ptr &calib_board, bool in_roi);
+        CloudType_::Ptr prepareOrganized(CloudType_::Ptr &cloud_in, const RingRangeImage& image, bool in_roi, bool use_i_gate, FrameArena& arena);
+        bool checkRGClusters(CloudType_::Ptr& cloud, const vector<pcl::PointIndices>& cluster_indices, CloudType_::Ptr& calib_board);
+        bool checkClusters(CloudType_::Ptr& cloud, const vector<pcl::PointIndices>& cluster_indices, CloudType_::Ptr& calib_board);
+        bool inTrackingROI(const PointType_& p) const;
+        void cropToTrackingROI(const CloudType_& cloud_in, CloudType_& cloud_out);
+        void updateTracking(const CloudType_& calib_board);
+        void extractClusterPlanes(CloudType_::Ptr& cloud, const pcl::PointIndices& cluster, BoardCheckList& checks, FrameArena& arena);
+        int classifyClusterPlanarity(const CloudType_& cloud, vector<int>& plane_inliers);
+        void checkRGCluster(CloudType_::Ptr& cloud, const pcl::PointIndices& cluster, BoardCheck& check, FrameArena& arena);
+        void checkRGClusterIndexed(CloudType_::Ptr& cloud, const pcl::PointIndices& cluster, BoardCheck& check, FrameArena& arena);
+        bool mergeBoardChecks(vector<BoardCheckList>& cluster_checks, CloudType_::Ptr& calib_board, bool color_planes);
         void regionGrowSeg(CloudType_::Ptr &cloud_in_, vector<pcl::PointIndices> &clusters_, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &colored_result_);
         CloudType_::Ptr IntensityFilter(CloudType_::Ptr& cloud_in, float rm_range_min, float rm_range_max);
+        void IntensityFilter(CloudType_::Ptr& cloud_in, CloudType_& cloud_out, float rm_range_min, float rm_range_max);
+        void hashVoxelDownsample(CloudType_::Ptr& cloud_in, CloudType_::Ptr& cloud_out, double leaf_size);
+        void fusedPrefilter(CloudType_::Ptr& cloud_in, CloudType_::Ptr& cloud_out, bool use_i_gate);
 
         #ifdef STATIC_ANALYSE
         void visualize_regist(CloudType_::Ptr& source, CloudType_::Ptr& target, CloudType_::Ptr& registed, Eigen::Vector4f& C_source_, Eigen::Vector4f& C_target_, Eigen::Matrix3f& U_source_, Eigen::Matrix3f& U_target_);
@@ -207,86 +448,163 @@ class AutoDetectLaser: public EstimateBoundary<PointType_>
 };
 
 
-bool AutoDetectLaser::detectCalibBoard(CloudType_::Ptr &cloud_in, 
-                                        CloudType_::Ptr &calib_board)
+bool AutoDetectLaser::detectCalibBoard(CloudType_::Ptr &cloud_in, CloudType_::Ptr &calib_board)
+{
+    return trackCalibBoard(calib_board, [&](bool in_roi)
+    {
+        if(!in_roi)
+            return searchCalibBoard(cloud_in, calib_board);
+        cropToTrackingROI(*cloud_in, *track_roi_);
+        if(DEBUG1) cout << "Tracking ROI: " << track_roi_->points.size() << " of " << cloud_in->points.size() << " points" << endl;
+        return searchCalibBoard(track_roi_, calib_board);
+    });
+}
+
+
+// image: the range image of the frame cloud_in is a copy of, i.e. with the same point order
+bool AutoDetectLaser::detectCalibBoard(CloudType_::Ptr &cloud_in, const RingRangeImage& image, CloudType_::Ptr &calib_board)
+{
+    return trackCalibBoard(calib_board, [&](bool in_roi)
+    {
+        return searchCalibBoardOrganized(cloud_in, image, calib_board, in_roi);
+    });
+}
+
+
+bool AutoDetectLaser::detectCalibBoardRG(CloudType_::Ptr &cloud_in, const RingRangeImage& image, CloudType_::Ptr &calib_board)
+{
+    return trackCalibBoard(calib_board, [&](bool in_roi)
+    {
+        return searchCalibBoardRGOrganized(cloud_in, image, calib_board, in_roi);
+    });
+}
+
+
+bool AutoDetectLaser::detectCalibBoardRG(CloudType_::Ptr &cloud_in, CloudType_::Ptr &calib_board)
+{
+    return trackCalibBoard(calib_board, [&](bool in_roi)
+    {
+        if(!in_roi)
+            return searchCalibBoardRG(cloud_in, calib_board);
+        cropToTrackingROI(*cloud_in, *track_roi_);
+        return searchCalibBoardRG(track_roi_, calib_board);
+    });
+}
+
+
+// Tracking mode: between two position changes the board stays where it is, so after a detection only the
+// bounding box of the last board, inflated by tracking_margin_, is searched, and the last transform is
+// tried as the registration start before the PCA hypotheses. A frame without a board in the box drops the
+// track and is searched again over the whole scene. search(in_roi) runs one detection pipeline.
+bool AutoDetectLaser::trackCalibBoard(CloudType_::Ptr &calib_board, const function<bool(bool)>& search)
 {
-    CloudType_::Ptr plane_cloud(new CloudType_),    // To store all detected planes
-                                        cloud_f(new CloudType_),        // Temp pc used for swaping
-                                        cloud2(new CloudType_),         // Temp pc used for swaping
-                                        // calib_board_boundary_(new CloudType_),
-                                        detected_boards(new CloudType_);
     bool detectable = false;
+    if(use_tracking_ && tracking_valid_)
+    {
+        warm_start_ = true;
+        detectable = search(true);
+        warm_start_ = false;
+        if(!detectable)
+        {
+            if(DEBUG1) ROS_WARN("[LASER] Lost the tracked board, searching the whole scene.");
+            tracking_valid_ = false;
+        }
+    }
+    if(!detectable)
+        detectable = search(false);
+    if(use_tracking_ && detectable)
+        updateTracking(*calib_board);
+    return detectable;
+}
+
+
+bool AutoDetectLaser::inTrackingROI(const PointType_& p) const
+{
+    return p.x >= track_min_[0] - tracking_margin_ && p.x <= track_max_[0] + tracking_margin_
+        && p.y >= track_min_[1] - tracking_margin_ && p.y <= track_max_[1] + tracking_margin_
+        && p.z >= track_min_[2] - tracking_margin_ && p.z <= track_max_[2] + tracking_margin_;
+}
+
+
+void AutoDetectLaser::cropToTrackingROI(const CloudType_& cloud_in, CloudType_& cloud_out)
+{
+    cloud_out.clear();
+    cloud_out.header = cloud_in.header;
+    for(const PointType_& p : cloud_in.points)
+    {
+        if(inTrackingROI(p))
+            cloud_out.points.push_back(p);
+    }
+    cloud_out.width = cloud_out.points.size();
+    cloud_out.height = 1;
+    cloud_out.is_dense = cloud_in.is_dense;
+}
+
+
+void AutoDetectLaser::updateTracking(const CloudType_& calib_board)
+{
+    if(calib_board.points.empty())
+        return;
+    Eigen::Vector4f min, max;
+    pcl::getMinMax3D(calib_board, min, max);
+    track_min_ = min.head<3>();
+    track_max_ = max.head<3>();
+    track_Tr_ = Tr_calib2tpl_;
+    tracking_valid_ = true;
+}
+
+
+bool AutoDetectLaser::searchCalibBoard(CloudType_::Ptr &cloud_in, 
+                                        CloudType_::Ptr &calib_board)
+{
+    resetArenas();
+    FrameArena& arena = arenas_[0];     // the calling thread is worker 0 of the pool
+    CloudType_::Ptr cloud2 = arena.clouds.acquire();    // Temp pc used for swaping
 
     #ifdef STATIC_ANALYSE
     showPointXYZI(cloud_in, 2, "Raw Cloud_in");
     #endif
     
-    // ************************ 1. x-filter ***********************
-    CloudType_::Ptr x_filtered (new CloudType_);
-    pcl::PassThrough<PointType_> pass_x;
-    pass_x.setFilterFieldName("x");
-    pass_x.setFilterLimits(remove_x_min_, remove_x_max_);
-    pass_x.setInputCloud(cloud_in);
-    pass_x.setNegative (true);
-    pass_x.filter(*x_filtered);
-    pcl::copyPointCloud(*x_filtered, *x_filtered_);
-
-    // ********************** 2. Downsampling *********************
-    if(use_vox_filter_)
-    {   
-        CloudType_::Ptr cloud_to_divide (new CloudType_);
-        pcl::VoxelGrid<PointType_> sor;
-
-        // The size of point cloud is too large. It's neccessary to divide it into multiple blocks to do downsampling
-        PointType_ minP, maxP;
-        pcl::getMinMax3D(*x_filtered, minP, maxP);
-        double dis_x = maxP.x - minP.x,
-                dis_y = maxP.y - minP.y,
-                dis_z = maxP.z - minP.z;
-        double volumn = dis_x * dis_y *dis_z;
-        int block_num = ceill(volumn / 3000);
-        if(DEBUG1)
-        {   
-            cout << "x_min = " << minP.x << "\tx_max = " << maxP.x << endl;
-            cout << "source cloud volumn = " << volumn << "\tblock_num = " << block_num << endl;
-        }
-        double add_dx = dis_x/block_num;
+    // ************** 1+2. x-filter, (intensity filter,) downsampling in one pass **************
+    if(use_fused_prefilter_)
+    {
+        fusedPrefilter(cloud_in, cloud2, use_i_filter_);
+        if(DEBUG1) cout << "PointCloud size after prefilter: " << cloud2->points.size() << endl;
+    }
+    else
+    {
+        // ************************ 1. x-filter ***********************
+        CloudType_::Ptr x_filtered = arena.clouds.acquire();
+        pcl::PassThrough<PointType_> pass_x;
+        pass_x.setFilterFieldName("x");
+        pass_x.setFilterLimits(remove_x_min_, remove_x_max_);
+        pass_x.setInputCloud(cloud_in);
+        pass_x.setNegative (true);
+        pass_x.filter(*x_filtered);
+        if(capture(CAPTURE_X_FILTERED))
+            pcl::copyPointCloud(*x_filtered, *x_filtered_);
+        else
+            x_filtered_->clear();
 
-        pcl::copyPointCloud(*x_filtered, *cloud_to_divide);
-        CloudType_::Ptr dx_filtered (new CloudType_);
-        CloudType_::Ptr block_filtered (new CloudType_);
-        
-        for(auto dx_min = minP.x; dx_min < maxP.x ; dx_min += add_dx)
+        // ********************** 2. Downsampling *********************
+        if(use_vox_filter_)
         {
-            // divide into blocks
-            auto dx_max = dx_min + add_dx;
-            pcl::PassThrough<PointType_> pass_dx;
-            pass_dx.setFilterFieldName("x");
-            pass_dx.setFilterLimits(dx_min, dx_max);
-            pass_dx.setInputCloud(cloud_to_divide);
-            pass_dx.setNegative (false);    // inliers
-            pass_dx.filter(*dx_filtered);
-            
-            pass_dx.setNegative(true);      // outliers
-            pass_dx.filter(*cloud_to_divide);
-
-            sor.setInputCloud(dx_filtered);
-            sor.setLeafSize(voxel_grid_size_, voxel_grid_size_, voxel_grid_size_);
-            sor.filter(*block_filtered);
-            
-
-            *cloud2 += *block_filtered;
+            // Hashed voxel grid: one pass over the whole scene, no block splitting needed for large volumes
+            hashVoxelDownsample(x_filtered, cloud2, voxel_grid_size_);
+            if(DEBUG1) 
+                cout << "PointCloud size after filter: " << cloud2->points.size() << endl;
         }
-        if(DEBUG1) 
-            cout << "PointCloud size after filter: " << cloud2->points.size() << endl;
+        else
+            pcl::copyPointCloud(*x_filtered, *cloud2);
     }
-    else
-        pcl::copyPointCloud(*x_filtered, *cloud2);
     // if(auto_mode_) showPointXYZI(cloud2, 1, "pointcloud after voxel");
-    pcl::copyPointCloud(*cloud2, *ds_filtered_);
+    if(capture(CAPTURE_DS_FILTERED))
+        pcl::copyPointCloud(*cloud2, *ds_filtered_);
+    else
+        ds_filtered_->clear();
 
     // ******************** 3. Gaussion filter *******************
-    CloudType_::Ptr cloud_gauss_filtered (new CloudType_);
+    CloudType_::Ptr cloud_gauss_filtered = arena.clouds.acquire();
     if(use_gauss_filter_)
     {
         // ------ Implementation of convolution filtering based on Gaussian kernel function ------
@@ -295,8 +613,7 @@ bool AutoDetectLaser::detectCalibBoard(CloudType_::Ptr &cloud_in,
         kernel.setThresholdRelativeToSigma(gauss_k_thre_rt_sigma_); //　Set the distance threshold relative to the sigma parameter
         kernel.setThreshold(gauss_k_thre_); //　Set the distance threshold, if the distance between points is greater than the threshold, these points will not be considered
 
-        pcl::search::KdTree<PointType_>::Ptr gauss_tree(new pcl::search::KdTree<PointType_>);
-        gauss_tree->setInputCloud(cloud2);
+        pcl::search::KdTree<PointType_>::Ptr gauss_tree = arena.trees.get(cloud2);
         
         // ------ Set Convolution parameters ------
         pcl::filters::Convolution3D<PointType_, PointType_, pcl::filters::GaussianKernel<PointType_, PointType_>> convolution;
@@ -309,260 +626,498 @@ bool AutoDetectLaser::detectCalibBoard(CloudType_::Ptr &cloud_in,
         convolution.convolve(*cloud_gauss_filtered);
         // if(auto_mode_) showPointXYZI(cloud_gauss_filtered, 1, "after gauss filter"); 
 
-        pcl::copyPointCloud(*cloud_gauss_filtered, *cloud2);
-        pcl::copyPointCloud(*cloud_gauss_filtered, *gs_filtered_);
+        if(capture(CAPTURE_GS_FILTERED))
+            pcl::copyPointCloud(*cloud_gauss_filtered, *gs_filtered_);
+        else
+            gs_filtered_->clear();
+        cloud2.swap(cloud_gauss_filtered);
     }
 
     // ************************* 5.1 intensity filter ***************************
-    if(use_i_filter_)
+    // (already applied per point in the fused prefilter)
+    if(use_i_filter_ && !use_fused_prefilter_)
     {
-        cloud2 = IntensityFilter(cloud2, i_filter_out_min_, i_filter_out_max_);
+        CloudType_::Ptr i_filtered = arena.clouds.acquire();
+        IntensityFilter(cloud2, *i_filtered, i_filter_out_min_, i_filter_out_max_);
+        cloud2.swap(i_filtered);
         #ifdef STATIC_ANALYSE
         showPointXYZI(filtered_plane, 2, "Intensity Filter Result");
         #endif 
     }
 
     // ************************ 4.Euclidean Cluster ******************************
-    pcl::search::KdTree<PointType_>::Ptr tree(new pcl::search::KdTree<PointType_>);
-    tree->setInputCloud(cloud2);
-    vector<pcl::PointIndices> cluster_indices;
-    pcl::EuclideanClusterExtraction<PointType_> euclidean_cluster;
-    euclidean_cluster.setClusterTolerance(cluster_tole_);   // Set the nearest neighbor search radius to 5cm
-    euclidean_cluster.setMinClusterSize(cluster_size_min_);
-    euclidean_cluster.setMaxClusterSize(cluster_size_max_);
-    euclidean_cluster.setSearchMethod(tree);
-    euclidean_cluster.setInputCloud(cloud2);
-    euclidean_cluster.extract(cluster_indices);
-
-
-    // ********************** 5. Plane Segmentation (in each cluster) ******************
+    if(cluster_method_ == CLUSTER_VOXEL)
+    {
+        voxel_cluster_.setClusterTolerance(cluster_tole_);
+        voxel_cluster_.setMinClusterSize(cluster_size_min_);
+        voxel_cluster_.setMaxClusterSize(cluster_size_max_);
+        voxel_cluster_.extract(*cloud2, cluster_indices_, &pool_);
+    }
+    else
+    {
+        pcl::search::KdTree<PointType_>::Ptr tree = arena.trees.get(cloud2);
+        pcl::EuclideanClusterExtraction<PointType_> euclidean_cluster;
+        euclidean_cluster.setClusterTolerance(cluster_tole_);   // Set the nearest neighbor search radius to 5cm
+        euclidean_cluster.setMinClusterSize(cluster_size_min_);
+        euclidean_cluster.setMaxClusterSize(cluster_size_max_);
+        euclidean_cluster.setSearchMethod(tree);
+        euclidean_cluster.setInputCloud(cloud2);
+        euclidean_cluster.extract(cluster_indices_);
+    }
+
+
+    if(DEBUG1) cout << cluster_indices_.size() << " clusters found from "  << cloud2->points.size() << " points in cloud" << endl;
+    return checkClusters(cloud2, cluster_indices_, calib_board);
+}
+
+
+// The same detection on the organized frame of a ring-based lidar: no voxel grid (the image is already a
+// regular sampling), the filters only mask pixels out, and the Gaussian filter and the clustering look up their
+// neighbours in the range image instead of a KD-tree.
+bool AutoDetectLaser::searchCalibBoardOrganized(CloudType_::Ptr &cloud_in, const RingRangeImage& image,
+                                        CloudType_::Ptr &calib_board, bool in_roi)
+{
+    resetArenas();
+    CloudType_::Ptr cloud2 = prepareOrganized(cloud_in, image, in_roi, use_i_filter_, arenas_[0]);
+    if(!cloud2)
+        return false;
+
+    // ************************ 4. range image cluster ******************************
+    image.cluster(organized_mask_, ri_range_thre_, cluster_size_min_, cluster_size_max_, cluster_indices_, ri_scratch_, ri_col_window_);
+    if(DEBUG1) cout << cluster_indices_.size() << " clusters found in the range image" << endl;
+    return checkClusters(cloud2, cluster_indices_, calib_board);
+}
+
+
+// Region growing on the organized frame: integral-image normals and growth over the image neighbours instead
+// of KNN normals and pcl::RegionGrowing with a KD-tree. RG_neighbor_n is not used, the image window takes its place.
+bool AutoDetectLaser::searchCalibBoardRGOrganized(CloudType_::Ptr &cloud_in, const RingRangeImage& image,
+                                        CloudType_::Ptr &calib_board, bool in_roi)
+{
+    resetArenas();
+    CloudType_::Ptr cloud2 = prepareOrganized(cloud_in, image, in_roi, false, arenas_[0]);  // intensity: per plane, in checkRGCluster()
+    if(!cloud2)
+        return false;
+
+    // ************************ 4. RG plane segmentation ******************************
+    image.computeNormals(*cloud2, *rg_normals_, ri_scratch_, ri_range_thre_, 1, 3, 5, &organized_mask_);
+    normal_cloud_ = cloud2;
+    image.growRegions(*cloud2, *rg_normals_, organized_mask_, pcl::deg2rad(RG_smooth_thre_deg_), RG_curve_thre_, ri_range_thre_,
+                        cluster_size_min_, cluster_size_max_, cluster_indices_, ri_scratch_, ri_col_window_);
+    if(DEBUG2) cout << cluster_indices_.size() << " regions found in the range image" << endl;
+
+    // as pcl::RegionGrowing::getColoredCloud(): a random color per region, the other points red
+    colored_planes_->clear();
+    region_of_.assign(cloud2->points.size(), -1);
+    for(size_t k = 0; k < cluster_indices_.size(); k++)
+    {
+        for(int i : cluster_indices_[k].indices)    region_of_[i] = k;
+    }
+    mt19937 rng(0u);
+    region_colors_.resize(cluster_indices_.size() * 3);
+    for(auto& c : region_colors_)   c = rng() % 256;
+    for(size_t i = 0; i < cloud2->points.size(); i++)
+    {
+        if(!organized_mask_[i])     continue;
+        pcl::PointXYZRGB p;
+        p.x = cloud2->points[i].x;  p.y = cloud2->points[i].y;  p.z = cloud2->points[i].z;
+        int k = region_of_[i];
+        p.r = k < 0 ? 255 : region_colors_[3 * k];
+        p.g = k < 0 ? 0 : region_colors_[3 * k + 1];
+        p.b = k < 0 ? 0 : region_colors_[3 * k + 2];
+        colored_planes_->points.push_back(p);
+    }
+    colored_planes_->width = colored_planes_->points.size();
+    colored_planes_->height = 1;
+
+    return checkRGClusters(cloud2, cluster_indices_, calib_board);
+}
+
+
+// ************** 1. x-filter, intensity filter (and tracking ROI) as a pixel mask, 3. Gaussian filter **************
+// The intensity gate only if use_i_gate. The mask is left in organized_mask_. Returns the filtered cloud, null if the image is not the one of cloud_in.
+CloudType_::Ptr AutoDetectLaser::prepareOrganized(CloudType_::Ptr &cloud_in, const RingRangeImage& image, bool in_roi, bool use_i_gate, FrameArena& arena)
+{
+    const size_t n = cloud_in->points.size();
+    if(image.points() != n)
+    {
+        ROS_WARN("[LASER] The range image does not belong to this cloud (%d vs %d points).", (int)image.points(), (int)n);
+        return CloudType_::Ptr();
+    }
+
+    // ************** 1. x-filter, intensity filter (and tracking ROI) as a pixel mask **************
+    const float x_min = remove_x_min_, x_max = remove_x_max_;
+    const float i_min = i_filter_out_min_, i_max = i_filter_out_max_;
+    organized_mask_.assign(n, 0);
+    int n_valid = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        if(image.pixel(i) < 0)  continue;
+        const PointType_& p = cloud_in->points[i];
+        bool keep = (p.x < x_min || p.x > x_max);
+        if(use_i_gate)      keep = keep && (p.intensity < i_min || p.intensity > i_max);
+        if(in_roi)          keep = keep && inTrackingROI(p);
+        organized_mask_[i] = keep;
+        n_valid += keep;
+    }
+    if(DEBUG1) cout << "Range image points after filter: " << n_valid << endl;
+    x_filtered_->clear();
+    ds_filtered_->clear();
+
+    // ******************** 3. Gaussion filter *******************
+    CloudType_::Ptr cloud2 = cloud_in;
+    if(use_gauss_filter_)
+    {
+        cloud2 = arena.clouds.acquire();
+        image.smooth(*cloud_in, *cloud2, gauss_k_sigma_, gauss_conv_radius_, &organized_mask_);
+        if(capture(CAPTURE_GS_FILTERED))
+        {
+            gs_filtered_->clear();
+            for(size_t i = 0; i < n; i++)
+            {
+                if(organized_mask_[i])  gs_filtered_->points.push_back(cloud2->points[i]);
+            }
+            gs_filtered_->width = gs_filtered_->points.size();
+            gs_filtered_->height = 1;
+        }
+        else
+            gs_filtered_->clear();
+    }
+    return cloud2;
+}
+
+
+// ********************** 5. Plane Segmentation + 6. board check (in each cluster) ******************
+// Clusters are independent: each task peels planes off one cluster and checks them against the template.
+// Results land in a per-cluster slot and are merged in cluster order below, so the output matches a serial run.
+bool AutoDetectLaser::checkClusters(CloudType_::Ptr& cloud, const vector<pcl::PointIndices>& cluster_indices, CloudType_::Ptr& calib_board)
+{
+    cluster_checks_.resize(cluster_indices.size());
+    pool_.parallelFor(cluster_indices.size(), [&](int i, int worker)
+    {
+        extractClusterPlanes(cloud, cluster_indices[i], cluster_checks_[i], arenas_[worker]);
+    });
+
+    plane_segments_.beginFrame();
+    bool detectable = mergeBoardChecks(cluster_checks_, calib_board, true);
+    colored_i_planes_ = plane_segments_.output();
+    if(DEBUG1 && plane_segments_.dropped() > 0)
+        ROS_WARN("[LASER] plane segment buffer full, %d points not shown", (int)plane_segments_.dropped());
+    #ifdef STATIC_ANALYSE
+    showPointXYZI(colored_i_planes_, 2, "Plane Segmentation Result");
+    #endif
+    // if(!detectable)
+    //     ROS_WARN("<<<<<<<<<<<<< [LASER] CANNOT find the calib borad!");
+    return detectable;
+}
+
+
+void AutoDetectLaser::extractClusterPlanes(CloudType_::Ptr& cloud, const pcl::PointIndices& cluster, BoardCheckList& checks, FrameArena& arena)
+{
+    checks.clear();
+    CloudType_::Ptr cloud_cluster = arena.clouds.acquire();
+    for(auto pit = cluster.indices.begin(); pit < cluster.indices.end(); pit++)
+    {
+        cloud_cluster->points.push_back(cloud->points[*pit]);
+    }
+    cloud_cluster->width = cloud_cluster->points.size();
+    cloud_cluster->height = 1;
+    cloud_cluster->is_dense = true;
+
+    if(DEBUG1) ROS_WARN("PointCloud represneting the Cluster: %d data points.", cloud_cluster->points.size());
+    // if(auto_mode_) showPointXYZI(cloud_cluster, 1, "cloud cluster");
+    #ifdef STATIC_ANALYSE
+    showPointXYZI(cloud_cluster, 2, "cluster cloud");
+    #endif 
+
+    // ------ voxel2 to uniform pcl ------
+    if(use_vox_filter_)
+    {
+        CloudType_::Ptr voxel2_filtered = arena.clouds.acquire();
+        pcl::VoxelGrid<PointType_> sor2;
+        sor2.setInputCloud(cloud_cluster);
+        sor2.setLeafSize(voxel_grid_size_, voxel_grid_size_, voxel_grid_size_);
+        sor2.filter(*voxel2_filtered);
+        cloud_cluster.swap(voxel2_filtered);
+    }
+
+    // ******************* statistical filter ******************
+    if(use_statistic_filter_)
+    {
+        CloudType_::Ptr cloud_s_filtered = arena.clouds.acquire();
+        pcl::StatisticalOutlierRemoval<PointType_> sor;
+        sor.setInputCloud(cloud_cluster);
+        sor.setMeanK(sor_MeanK_);
+        sor.setStddevMulThresh(sor_StddevMulThresh_);
+        sor.filter(*cloud_s_filtered);
+        if(DEBUG1) cout << "cluster size after statistic filter = " << cloud_s_filtered->points.size() << endl;
+        cloud_cluster.swap(cloud_s_filtered);
+        // if(auto_mode_) visualPointXYZI(cloud_cluster, 1, "cloud cluster after statistic filter");	
+    }
+
+    // ******************* planarity pre-check ******************
+    if(use_planarity_check_)
+    {
+        pcl::PointIndices::Ptr plane_inliers = arena.indices.acquire();
+        int planarity = classifyClusterPlanarity(*cloud_cluster, plane_inliers->indices);
+        if(planarity == PLANARITY_REJECT)
+            return;
+        if(planarity == PLANARITY_PLANE)
+        {
+            BoardCheck check;
+            check.plane = arena.clouds.acquire();
+            pcl::copyPointCloud(*cloud_cluster, plane_inliers->indices, *check.plane);
+            checkCalibBoard(check.plane, check, arena);
+            checks.push_back(check);
+            return;
+        }
+    }
+
+    // one segmenter per task: SACSegmentation keeps its model and rng as state
     pcl::SACSegmentation<PointType_> plane_segmentation;
     plane_segmentation.setOptimizeCoefficients(true);   // Reestimate model parameters using interior points
     plane_segmentation.setModelType(pcl::SACMODEL_PLANE);
     plane_segmentation.setMethodType(pcl::SAC_RANSAC);
     plane_segmentation.setDistanceThreshold(Pseg_dis_thre_);
     plane_segmentation.setMaxIterations(Pseg_iter_num_);
-
-    pcl::ModelCoefficients::Ptr coefficients (new pcl::ModelCoefficients);
-    pcl::PointIndices::Ptr inliers (new pcl::PointIndices);
-
-    pcl::ExtractIndices<PointType_> extract_plane;
-    int seg_num = 0, pos_num = 0, true_pos_num = 0;
-    if(DEBUG1) cout << cluster_indices.size() << " clusters found from "  << cloud2->points.size() << " points in cloud" << endl;
-    
-    for(auto it = cluster_indices.begin(); it < cluster_indices.end(); it++)
+    AdaptivePlaneRansac plane_ransac;
+    plane_ransac.setDistanceThreshold(Pseg_dis_thre_);
+    plane_ransac.setMaxIterations(Pseg_iter_num_);
+
+    pcl::ModelCoefficients::Ptr coefficients = arena.coefficients.acquire();
+    pcl::PointIndices::Ptr inliers = arena.indices.acquire();
+
+    // Planes are peeled off by index: cloud_cluster stays as it is, active holds the points not yet
+    // taken by a plane (in cluster order, as the outlier copy used to), and only the plane itself is copied.
+    pcl::PointIndices::Ptr active = arena.indices.acquire();
+    vector<uint8_t>& taken = arena.mask;
+    int full_cloud_size = cloud_cluster->points.size();
+    active->indices.resize(full_cloud_size);
+    for(int i = 0; i < full_cloud_size; i++)
+        active->indices[i] = i;
+    taken.assign(full_cloud_size, 0);
+    plane_segmentation.setInputCloud (cloud_cluster);
+    while(active->indices.size() > 0 && active->indices.size() > (Pseg_size_min_ * full_cloud_size))
     {
-        CloudType_::Ptr cloud_cluster(new CloudType_);
-        PointType_ tmp_p;
-        for(auto pit = it->indices.begin(); pit < it->indices.end(); pit++)
+        pcl::console::TicToc t_seg;
+        double Pseg_time_ = 0.0;
+        t_seg.tic();
+        if(use_adaptive_ransac_)
         {
-            cloud_cluster->points.push_back(cloud2->points[*pit]);
+            Eigen::Vector4f plane_model = Eigen::Vector4f::Zero();
+            plane_ransac.segment(*cloud_cluster, active->indices, inliers->indices, plane_model);
+            coefficients->values.assign(plane_model.data(), plane_model.data() + 4);
+        }
+        else
+        {
+            plane_segmentation.setIndices (active);
+            plane_segmentation.segment (*inliers, *coefficients);
+        }
+
+        // if (inliers->indices.size () == 0)
+        if (inliers->indices.size () < cluster_size_min_)
+        {
+            if(DEBUG1) ROS_WARN("<<<<<< [Laser] Could not estimate a planar model for the given dataset.");
+            break;
+        }
+        Pseg_time_ = t_seg.toc();
+        if(DEBUG1) 
+        {
+            ROS_WARN("Segmentation No.%d of cluster\tspend[%fms]", (int)checks.size() + 1, Pseg_time_);
+            cout << "number of point clouds in the plane: " << inliers->indices.size() << endl;
+            if(use_adaptive_ransac_)    cout << "RANSAC hypotheses: " << plane_ransac.iterations() << endl;
         }
-        cloud_cluster->width = cloud_cluster->points.size();
-        cloud_cluster->height = 1;
-        cloud_cluster->is_dense = true;
 
-        if(DEBUG1) ROS_WARN("PointCloud represneting the Cluster: %d data points.", cloud_cluster->points.size());
-        // if(auto_mode_) showPointXYZI(cloud_cluster, 1, "cloud cluster");
+        BoardCheck check;
+        check.plane = arena.clouds.acquire();
+        pcl::copyPointCloud(*cloud_cluster, inliers->indices, *check.plane);   // inliers index cloud_cluster
+
         #ifdef STATIC_ANALYSE
-        showPointXYZI(cloud_cluster, 2, "cluster cloud");
+        showPointXYZI(check.plane, 2, "Unknown Plane");
         #endif 
 
-        // ------ voxel2 to uniform pcl ------
-        if(use_vox_filter_)
-        {
-            CloudType_::Ptr voxel2_filtered(new CloudType_);
-            pcl::VoxelGrid<PointType_> sor2;
-            sor2.setInputCloud(cloud_cluster);
-            sor2.setLeafSize(voxel_grid_size_, voxel_grid_size_, voxel_grid_size_);
-            sor2.filter(*voxel2_filtered);
-            pcl::copyPointCloud(*voxel2_filtered, *cloud_cluster);
-        }
+        // ************************* 6. justifying if it's the calib board ****************
+        checkCalibBoard(check.plane, check, arena);
+        checks.push_back(check);
 
-        // ******************* statistical filter ******************
-        if(use_statistic_filter_)
+        for(int idx : inliers->indices)
+            taken[idx] = 1;
+        size_t n_active = 0;
+        for(int idx : active->indices)
         {
-            CloudType_::Ptr cloud_s_filtered(new CloudType_);
-            pcl::StatisticalOutlierRemoval<PointType_> sor;
-            sor.setInputCloud(cloud_cluster);
-            sor.setMeanK(sor_MeanK_);
-            sor.setStddevMulThresh(sor_StddevMulThresh_);
-            sor.filter(*cloud_s_filtered);
-            if(DEBUG1) cout << "cluster size after statistic filter = " << cloud_s_filtered->points.size() << endl;
-            pcl::copyPointCloud(*cloud_s_filtered, *cloud_cluster);
-            // if(auto_mode_) visualPointXYZI(cloud_cluster, 1, "cloud cluster after statistic filter");	
+            if(!taken[idx])     active->indices[n_active++] = idx;
         }
+        active->indices.resize(n_active);
+        if(DEBUG1) ROS_INFO("Remianing %d points in cloud", (int)active->indices.size());
+    }
+}
 
-        int full_cloud_size = cloud_cluster->points.size();
-        while(cloud_cluster->points.size() > 0 && cloud_cluster->points.size() > (Pseg_size_min_ * full_cloud_size))
-        {
-            bool is_detected_calib = false;
-            pcl::console::TicToc t_seg;
-            double Pseg_time_ = 0.0;
-            t_seg.tic();
-            plane_segmentation.setInputCloud (cloud_cluster);
-            plane_segmentation.segment (*inliers, *coefficients);
 
-            // if (inliers->indices.size () == 0)
-            if (inliers->indices.size () < cluster_size_min_)
-            {
-                if(DEBUG1) ROS_WARN("<<<<<< [Laser] Could not estimate a planar model for the given dataset.");
-                break;
-            }
-            seg_num++;
-            Pseg_time_ = t_seg.toc();
-            // Pseg_time_v.push_back(Pseg_time_);
-            if(DEBUG1) 
-            {
-                ROS_WARN("Segmentation No.%d\tspend[%fms]", seg_num, Pseg_time_);
-                // cout << "segmentation No." << seg_num << "\tspend [" << t_seg.toc() << "ms]" <<endl;
-                cout << "number of point clouds in the plane: " << inliers->indices.size() << endl;
-            }
+// One covariance of the cluster decides how it is handled:
+// - PLANARITY_REJECT: smaller than half the board height, or a single plane larger than the board
+//   (RANSAC would return that plane whole, and it cannot match the template)
+// - PLANARITY_PLANE: a single plane of at most board size; plane_inliers gets the points within
+//   Pseg_dis_thre_ of its least-squares plane, the candidate RANSAC would have found
+// - PLANARITY_AMBIGUOUS: anything else, left to the plane peeling
+// Extents are measured along the in-plane PCA axes, so they do not depend on the viewing angle.
+int AutoDetectLaser::classifyClusterPlanarity(const CloudType_& cloud, vector<int>& plane_inliers)
+{
+    plane_inliers.clear();
+    const int n = cloud.points.size();
+    if(n < 3)
+        return PLANARITY_AMBIGUOUS;
+
+    Eigen::Vector3d mean = Eigen::Vector3d::Zero();
+    for(auto& p : cloud.points)
+        mean += Eigen::Vector3d(p.x, p.y, p.z);
+    mean /= n;
+    Eigen::Matrix3d cov = Eigen::Matrix3d::Zero();
+    for(auto& p : cloud.points)
+    {
+        Eigen::Vector3d d(p.x - mean[0], p.y - mean[1], p.z - mean[2]);
+        cov += d * d.transpose();
+    }
+    cov /= n;
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(cov);    // eigenvalues in increasing order
+    const Eigen::Vector3d normal = es.eigenvectors().col(0), axis_minor = es.eigenvectors().col(1), axis_major = es.eigenvectors().col(2);
+    double min_major = DBL_MAX, max_major = -DBL_MAX, min_minor = DBL_MAX, max_minor = -DBL_MAX;
+    for(auto& p : cloud.points)
+    {
+        Eigen::Vector3d d(p.x - mean[0], p.y - mean[1], p.z - mean[2]);
+        double a = d.dot(axis_major), b = d.dot(axis_minor);
+        min_major = min(min_major, a);  max_major = max(max_major, a);
+        min_minor = min(min_minor, b);  max_minor = max(max_minor, b);
+    }
+    const double extent_major = max_major - min_major, extent_minor = max_minor - min_minor;
+    const double board_major = max(board_w_, board_h_), board_minor = min(board_w_, board_h_);
+    if(DEBUG1) cout << "cluster extent " << extent_major << " x " << extent_minor << ", thickness " << sqrt(max(0.0, es.eigenvalues()[0])) << endl;
 
-            extract_plane.setInputCloud(cloud_cluster);
-            extract_plane.setIndices (inliers);
-            extract_plane.setNegative (false);    //extract_plane inliers
-            extract_plane.filter (*plane_cloud);
+    if(extent_major < 0.5 * board_minor)
+    {
+        if(DEBUG1) ROS_INFO("cluster smaller than the board, skipped");
+        return PLANARITY_REJECT;
+    }
+    if(sqrt(max(0.0, es.eigenvalues()[0])) >= Pseg_dis_thre_)
+        return PLANARITY_AMBIGUOUS;
+
+    const double d0 = -normal.dot(mean);
+    for(int i = 0; i < n; i++)
+    {
+        const PointType_& p = cloud.points[i];
+        if(fabs(normal[0] * p.x + normal[1] * p.y + normal[2] * p.z + d0) < Pseg_dis_thre_)
+            plane_inliers.push_back(i);
+    }
+    if(plane_inliers.size() < planar_inlier_ratio_ * n)
+    {
+        plane_inliers.clear();
+        return PLANARITY_AMBIGUOUS;
+    }
+    if(extent_major > board_extent_tol_ * board_major || extent_minor > board_extent_tol_ * board_minor)
+    {
+        if(DEBUG1) ROS_INFO("planar cluster larger than the board, skipped");
+        plane_inliers.clear();
+        return PLANARITY_REJECT;
+    }
+    if(plane_inliers.size() < cluster_size_min_)
+    {
+        plane_inliers.clear();
+        return PLANARITY_AMBIGUOUS;
+    }
+    if(DEBUG1) ROS_INFO("planar cluster of board size, %d plane points", (int)plane_inliers.size());
+    return PLANARITY_PLANE;
+}
 
-            #ifdef STATIC_ANALYSE
-            showPointXYZI(plane_cloud, 2, "Unknown Plane");
-            #endif 
-            // ************************* 5.1 intensity filter ***************************
-            // CloudType_::Ptr filtered_plane (new CloudType_);
-            // if(use_i_filter_)
-            // {
-            //     filtered_plane = IntensityFilter(plane_cloud, i_filter_out_min_, i_filter_out_max_);
-            //     #ifdef STATIC_ANALYSE
-            //     showPointXYZI(filtered_plane, 2, "Intensity Filter Result");
-            //     #endif 
-            // }
-            // else
-            //     pcl::copyPointCloud(*plane_cloud, *filtered_plane);
 
+// Replay the per-plane results in cluster order, exactly as the serial loop used to:
+// segments are numbered globally, the last evaluated plane leaves its scores in the members,
+// and the last positive plane sets Tr_calib2tpl_ and the board boundaries.
+bool AutoDetectLaser::mergeBoardChecks(vector<BoardCheckList>& cluster_checks, CloudType_::Ptr& calib_board, bool color_planes)
+{
+    CloudType_::Ptr detected_boards = arenas_[0].clouds.acquire();
+    const BoardCheck *last_pca_pc = nullptr, *last_pca_boundary = nullptr, *last_icp_boundary = nullptr;
+    bool detectable = false;
+    int seg_num = 0;
+    for(auto cit = cluster_checks.begin(); cit < cluster_checks.end(); cit++)
+    {
+        for(auto it = cit->begin(); it < cit->end(); it++)
+        {
+            seg_num++;
             // ************************* 5.2 coloring for visiualization ***************************
-            pcl::PointCloud<pcl::PointXYZI>::Ptr colored_i_plane(new pcl::PointCloud<pcl::PointXYZI>);
-            pcl::copyPointCloud(*plane_cloud, *colored_i_plane);
-            for(auto it = colored_i_plane->points.begin(); it < colored_i_plane->points.end(); it++)
+            if(color_planes && capture(CAPTURE_PLANE_SEGMENTS))
             {
-                it->intensity = seg_num;
+                plane_segments_.addSegment(*(it->plane), seg_num);
             }
-            *colored_i_planes_ += *colored_i_plane;
-
-            // ************************* 6. justifying if it's the calib board ****************
-            CloudType_::Ptr boundary_registed(new CloudType_);
-            CloudType_::Ptr boundary(new CloudType_);
-            double check_time_ = 0.0;
-            pcl::console::TicToc t_check;
-            t_check.tic();
-            // is_detected_calib = isCalibBoard(filtered_plane, boundary, boundary_registed);
-            is_detected_calib = isCalibBoard(plane_cloud, boundary, boundary_registed);
-            check_time_ = t_check.toc();
-            // check_time_v.push_back(check_time_);
-            if(is_detected_calib)
+
+            // scores per plane, the debug clouds only once for the last plane that produced them
+            applyBoardCheck(*it, false);
+            if(it->pca_regist_pc)           last_pca_pc = &(*it);
+            if(it->pca_regist_boundary)     last_pca_boundary = &(*it);
+            if(it->icp_regist_boundary)     last_icp_boundary = &(*it);
+            if(it->is_board)
             {
                 if(DEBUG1) ROS_WARN("<<<<<<<<<<<<< [LASER] Have found the calib borad point cloud!!!");
                 detectable = true;
-                pos_num ++;
-                Tr_calib2tpl_ = Tr_ukn2tpl_;
-                // *detected_boards += *filtered_plane;
-                // pcl::copyPointCloud(*filtered_plane, *calib_board);
-                *detected_boards += *plane_cloud;
-                pcl::copyPointCloud(*plane_cloud, *calib_board);
-                pcl::copyPointCloud(*boundary_registed, *calib_board_boundary_registed_);
-                pcl::copyPointCloud(*boundary, *calib_board_boundary_);
+                Tr_calib2tpl_ = it->Tr_ukn2tpl;
+                *detected_boards += *(it->plane);
+                pcl::copyPointCloud(*(it->boundary_registed), *calib_board_boundary_registed_);
+                pcl::copyPointCloud(*(it->boundary), *calib_board_boundary_);
             }
-
-            extract_plane.setNegative (true);     // extract_plane outliers
-            extract_plane.filter(*cloud_f);
-            cloud_cluster.swap(cloud_f);
-            if(DEBUG1) ROS_INFO("Remianing %d points in cloud", cloud_cluster->points.size());
         }
-    }    
-    #ifdef STATIC_ANALYSE
-    showPointXYZI(colored_i_planes_, 2, "Plane Segmentation Result");
-    #endif
-    // if(!detectable)
-    //     ROS_WARN("<<<<<<<<<<<<< [LASER] CANNOT find the calib borad!");
+    }
+    if(last_pca_pc)         pcl::copyPointCloud(*(last_pca_pc->pca_regist_pc), *pca_regist_pc_);
+    if(last_pca_boundary)   pcl::copyPointCloud(*(last_pca_boundary->pca_regist_boundary), *pca_regist_boundary_);
+    if(last_icp_boundary)   pcl::copyPointCloud(*(last_icp_boundary->icp_regist_boundary), *icp_regist_boundary_);
     pcl::copyPointCloud(*detected_boards, *calib_board);
     return detectable;
 }
 
 
-bool AutoDetectLaser::detectCalibBoardRG(CloudType_::Ptr &cloud_in, 
+bool AutoDetectLaser::searchCalibBoardRG(CloudType_::Ptr &cloud_in, 
                                         CloudType_::Ptr &calib_board)
 {
-    CloudType_::Ptr plane_cloud(new CloudType_),    // To store all detected planes
-                                        cloud_f(new CloudType_),        // Temp pc used for swaping
-                                        cloud2(new CloudType_),         // Temp pc used for swaping
-                                        // calib_board_boundary_(new CloudType_),
-                                        detected_boards(new CloudType_);
-    bool detectable = false;
-    // ************************ 1. x-filter ***********************
-    CloudType_::Ptr x_filtered (new CloudType_);
-    pcl::PassThrough<PointType_> pass_x;
-    pass_x.setFilterFieldName("x");
-    pass_x.setFilterLimits(remove_x_min_, remove_x_max_);
-    pass_x.setInputCloud(cloud_in);
-    pass_x.setNegative (true);
-    pass_x.filter(*x_filtered);
-    pcl::copyPointCloud(*x_filtered, *x_filtered_);
-
-    // ********************** 2. Downsampling *********************
-    if(use_vox_filter_)
-    {   
-        CloudType_::Ptr cloud_to_divide (new CloudType_);
-        pcl::VoxelGrid<PointType_> sor;
-
-        // 输入点云空间体量过大，需分块后进行下采样
-        PointType_ minP, maxP;
-        pcl::getMinMax3D(*x_filtered, minP, maxP);
-        double dis_x = maxP.x - minP.x,
-                dis_y = maxP.y - minP.y,
-                dis_z = maxP.z - minP.z;
-        double volumn = dis_x * dis_y *dis_z;
-        int block_num = ceill(volumn / 3000);
-        if(DEBUG1)
-        {   
-            cout << "x_min = " << minP.x << "\tx_max = " << maxP.x << endl;
-            cout << "source cloud volumn = " << volumn << "\tblock_num = " << block_num << endl;
-        }
-        double add_dx = dis_x/block_num;
+    resetArenas();
+    FrameArena& arena = arenas_[0];     // the calling thread is worker 0 of the pool
+    CloudType_::Ptr cloud2 = arena.clouds.acquire();    // Temp pc used for swaping
+    // ************** 1+2. x-filter, (intensity filter,) downsampling in one pass **************
+    if(use_fused_prefilter_)
+    {
+        fusedPrefilter(cloud_in, cloud2, false);
+        if(DEBUG1) cout << "PointCloud size after prefilter: " << cloud2->points.size() << endl;
+    }
+    else
+    {
+        // ************************ 1. x-filter ***********************
+        CloudType_::Ptr x_filtered = arena.clouds.acquire();
+        pcl::PassThrough<PointType_> pass_x;
+        pass_x.setFilterFieldName("x");
+        pass_x.setFilterLimits(remove_x_min_, remove_x_max_);
+        pass_x.setInputCloud(cloud_in);
+        pass_x.setNegative (true);
+        pass_x.filter(*x_filtered);
+        if(capture(CAPTURE_X_FILTERED))
+            pcl::copyPointCloud(*x_filtered, *x_filtered_);
+        else
+            x_filtered_->clear();
 
-        pcl::copyPointCloud(*x_filtered, *cloud_to_divide);
-        CloudType_::Ptr dx_filtered (new CloudType_);
-        CloudType_::Ptr block_filtered (new CloudType_);
-        
-        for(auto dx_min = minP.x; dx_min < maxP.x ; dx_min += add_dx)
+        // ********************** 2. Downsampling *********************
+        if(use_vox_filter_)
         {
-            // divide into blocks
-            auto dx_max = dx_min + add_dx;
-            pcl::PassThrough<PointType_> pass_dx;
-            pass_dx.setFilterFieldName("x");
-            pass_dx.setFilterLimits(dx_min, dx_max);
-            pass_dx.setInputCloud(cloud_to_divide);
-            pass_dx.setNegative (false);    // inliers
-            pass_dx.filter(*dx_filtered);
-            
-            pass_dx.setNegative(true);      // outliers
-            pass_dx.filter(*cloud_to_divide);
-
-            sor.setInputCloud(dx_filtered);
-            sor.setLeafSize(voxel_grid_size_, voxel_grid_size_, voxel_grid_size_);
-            sor.filter(*block_filtered);
-            
-
-            *cloud2 += *block_filtered;
+            // Hashed voxel grid: one pass over the whole scene, no block splitting needed for large volumes
+            hashVoxelDownsample(x_filtered, cloud2, voxel_grid_size_);
+            if(DEBUG1) 
+                cout << "PointCloud size after filter: " << cloud2->points.size() << endl;
         }
-        if(DEBUG1) 
-            cout << "PointCloud size after filter: " << cloud2->points.size() << endl;
+        else
+            pcl::copyPointCloud(*x_filtered, *cloud2);
     }
-    else
-        pcl::copyPointCloud(*x_filtered, *cloud2);
     // if(auto_mode_) showPointXYZI(cloud2, 1, "pointcloud after voxel");
 
-    pcl::copyPointCloud(*cloud2, *ds_filtered_);
+    if(capture(CAPTURE_DS_FILTERED))
+        pcl::copyPointCloud(*cloud2, *ds_filtered_);
+    else
+        ds_filtered_->clear();
     // ******************** 3. Gaussion filter *******************
-    CloudType_::Ptr cloud_gauss_filtered (new CloudType_);
+    CloudType_::Ptr cloud_gauss_filtered = arena.clouds.acquire();
     if(use_gauss_filter_)
     {
         // **************** 基于高斯核函数的卷积滤波实现 *****************
@@ -572,8 +1127,7 @@ bool AutoDetectLaser::detectCalibBoardRG(CloudType_::Ptr &cloud_in,
         kernel.setThreshold(gauss_k_thre_); //　设置距离阈值，若点间距离大于阈值则不予考虑
         // cout << "Kernel made" << endl;
 
-        pcl::search::KdTree<PointType_>::Ptr gauss_tree(new pcl::search::KdTree<PointType_>);
-        gauss_tree->setInputCloud(cloud2);
+        pcl::search::KdTree<PointType_>::Ptr gauss_tree = arena.trees.get(cloud2);
         // cout << "KdTree made" << endl;
         
         // *************** 设置Convolution相关参数 *****************
@@ -589,124 +1143,159 @@ bool AutoDetectLaser::detectCalibBoardRG(CloudType_::Ptr &cloud_in,
         // cout << "cluster size after gauss filter: " << cloud_gauss_filtered->points.size() << endl;
         // if(auto_mode_) showPointXYZI(cloud_gauss_filtered, 1, "after gauss filter"); 
 
-        pcl::copyPointCloud(*cloud_gauss_filtered, *cloud2);
-
-        pcl::copyPointCloud(*cloud_gauss_filtered, *gs_filtered_);
+        if(capture(CAPTURE_GS_FILTERED))
+            pcl::copyPointCloud(*cloud_gauss_filtered, *gs_filtered_);
+        else
+            gs_filtered_->clear();
+        cloud2.swap(cloud_gauss_filtered);
     }
 
     // ************************ 4. RG plane segmentation ******************************
-    vector<pcl::PointIndices> cluster_indices;
     // pcl::PointCloud<pcl::PointXYZRGB>::Ptr colored_planes_ (new pcl::PointCloud<pcl::PointXYZRGB>);
 
-    regionGrowSeg(cloud2, cluster_indices, colored_planes_);
+    regionGrowSeg(cloud2, cluster_indices_, colored_planes_);
+
+    if(DEBUG2) cout << cluster_indices_.size() << " clusters found from "  << cloud2->points.size() << " points in cloud" << endl;
+    return checkRGClusters(cloud2, cluster_indices_, calib_board);
+}
+
+
+// every RG cluster is one plane candidate, checked in parallel and merged in cluster order
+bool AutoDetectLaser::checkRGClusters(CloudType_::Ptr& cloud, const vector<pcl::PointIndices>& cluster_indices, CloudType_::Ptr& calib_board)
+{
+    cluster_checks_.resize(cluster_indices.size());
+    pool_.parallelFor(cluster_indices.size(), [&](int i, int worker)
+    {
+        cluster_checks_[i].resize(1);
+        checkRGCluster(cloud, cluster_indices[i], cluster_checks_[i][0], arenas_[worker]);
+    });
+
+    // if(!detectable)
+    //     ROS_WARN("<<<<<<<<<<<<< [LASER] CANNOT find the calib borad!");
+    return mergeBoardChecks(cluster_checks_, calib_board, false);
+}
+
 
+void AutoDetectLaser::checkRGCluster(CloudType_::Ptr& cloud, const pcl::PointIndices& cluster, BoardCheck& check, FrameArena& arena)
+{
+    check = BoardCheck();
+    // the cached normals are only read by the kNN boundary estimation
+    if(use_normal_cache_ && !use_grid_boundary_ && normal_cloud_ == cloud)
+    {
+        checkRGClusterIndexed(cloud, cluster, check, arena);
+        return;
+    }
+    CloudType_::Ptr plane_cloud = arena.clouds.acquire();
+    pcl::PointIndices::Ptr cluster_indice_ptr = arena.indices.acquire();
+    cluster_indice_ptr->indices = cluster.indices;
     pcl::ExtractIndices<PointType_> extract_plane;
- 
+    extract_plane.setInputCloud(cloud);
+    extract_plane.setIndices (cluster_indice_ptr);
+    extract_plane.setNegative (false);    //extract_plane inliers
+    extract_plane.filter (*plane_cloud);
 
-    int seg_num = 0, pos_num = 0, true_pos_num = 0;
-    if(DEBUG2) cout << cluster_indices.size() << " clusters found from "  << cloud2->points.size() << " points in cloud" << endl;
-    
-    for(auto it = cluster_indices.begin(); it < cluster_indices.end(); it++)
-    {
-        CloudType_::Ptr cloud_cluster(new CloudType_);
-        // for(auto pit = it->indices.begin(); pit < it->indices.end(); pit++)
-        // {
-        //     cloud_cluster->points.push_back(cloud2->points[*pit]);
-        // }
-        // cloud_cluster->width = cloud_cluster->points.size();
-        // cloud_cluster->height = 1;
-        // cloud_cluster->is_dense = true;
-        pcl::PointIndices::Ptr cluster_indice_ptr(new pcl::PointIndices(*it));
-        extract_plane.setInputCloud(cloud2);
-        extract_plane.setIndices (cluster_indice_ptr);
-        extract_plane.setNegative (false);    //extract_plane inliers
-        extract_plane.filter (*plane_cloud);
-
-        if(DEBUG1) ROS_WARN("PointCloud represneting the Cluster: %d data points.", plane_cloud->points.size());
-        // if(auto_mode_) showPointXYZI(cloud_cluster, 1, "cloud cluster");
-
-        // ******************* voxel2 to uniform pcl ******************
-        if(use_vox_filter_)
-        {
-            CloudType_::Ptr voxel2_filtered(new CloudType_);
-            pcl::VoxelGrid<PointType_> sor2;
-            sor2.setInputCloud(plane_cloud);
-            sor2.setLeafSize(voxel_grid_size_, voxel_grid_size_, voxel_grid_size_);
-            sor2.filter(*voxel2_filtered);
-            pcl::copyPointCloud(*voxel2_filtered, *plane_cloud);
-        }
+    if(DEBUG1) ROS_WARN("PointCloud represneting the Cluster: %d data points.", plane_cloud->points.size());
+    // if(auto_mode_) showPointXYZI(cloud_cluster, 1, "cloud cluster");
 
-         // ******************* statistical filter ******************
-        if(use_statistic_filter_)
-        {
-            CloudType_::Ptr cloud_s_filtered(new CloudType_);
-            pcl::StatisticalOutlierRemoval<PointType_> sor;
-            sor.setInputCloud(plane_cloud);
-            sor.setMeanK(sor_MeanK_);
-            sor.setStddevMulThresh(sor_StddevMulThresh_);
-            sor.filter(*cloud_s_filtered);
-            if(DEBUG1) cout << "cluster size after statistic filter = " << cloud_s_filtered->points.size() << endl;
-            pcl::copyPointCloud(*cloud_s_filtered, *plane_cloud);
-            // if(auto_mode_) visualPointXYZI(cloud_cluster, 1, "cloud cluster after statistic filter");	
-        }
+    // ******************* voxel2 to uniform pcl ******************
+    if(use_vox_filter_)
+    {
+        CloudType_::Ptr voxel2_filtered = arena.clouds.acquire();
+        pcl::VoxelGrid<PointType_> sor2;
+        sor2.setInputCloud(plane_cloud);
+        sor2.setLeafSize(voxel_grid_size_, voxel_grid_size_, voxel_grid_size_);
+        sor2.filter(*voxel2_filtered);
+        plane_cloud.swap(voxel2_filtered);
+    }
 
-        bool is_detected_calib = false;    // 算法检测是否是标定板
-        // Pseg_time_v.push_back(Pseg_time_);
+     // ******************* statistical filter ******************
+    if(use_statistic_filter_)
+    {
+        CloudType_::Ptr cloud_s_filtered = arena.clouds.acquire();
+        pcl::StatisticalOutlierRemoval<PointType_> sor;
+        sor.setInputCloud(plane_cloud);
+        sor.setMeanK(sor_MeanK_);
+        sor.setStddevMulThresh(sor_StddevMulThresh_);
+        sor.filter(*cloud_s_filtered);
+        if(DEBUG1) cout << "cluster size after statistic filter = " << cloud_s_filtered->points.size() << endl;
+        plane_cloud.swap(cloud_s_filtered);
+        // if(auto_mode_) visualPointXYZI(cloud_cluster, 1, "cloud cluster after statistic filter");	
+    }
 
+    // ************************* 5.1 intensity filter ***************************
+    if(use_i_filter_)
+    {
+        check.plane = arena.clouds.acquire();
+        IntensityFilter(plane_cloud, *check.plane, i_filter_out_min_, i_filter_out_max_);
+    }
+    else
+        check.plane = plane_cloud;
 
+    // ************************* 6. justifying if it's the calib board ****************
+    checkCalibBoard(check.plane, check, arena);
+}
 
-        // ************************* 5.1 intensity filter ***************************
-        CloudType_::Ptr filtered_plane(new CloudType_);
-        if(use_i_filter_)
-            filtered_plane = IntensityFilter(plane_cloud, i_filter_out_min_, i_filter_out_max_);
-        else
-            pcl::copyPointCloud(*plane_cloud, *filtered_plane);
 
-        // ************************* 5.2 coloring for visiualization ***************************
+// checkRGCluster() on frame indices: the filters narrow down the index list, the plane is copied once at the end
+// and keeps its indices, so checkCalibBoard() can take the normals of the region growing.
+// No voxel2: the frame is already on the voxel grid (or organized, one point per pixel).
+void AutoDetectLaser::checkRGClusterIndexed(CloudType_::Ptr& cloud, const pcl::PointIndices& cluster, BoardCheck& check, FrameArena& arena)
+{
+    pcl::PointIndices::Ptr plane_indices = arena.indices.acquire();
+    plane_indices->indices = cluster.indices;
+    vector<int>& idx = plane_indices->indices;
+    if(DEBUG1) ROS_WARN("PointCloud represneting the Cluster: %d data points.", idx.size());
 
+     // ******************* statistical filter ******************
+    if(use_statistic_filter_)
+    {
+        CloudType_::Ptr cluster_cloud = arena.clouds.acquire();
+        pcl::copyPointCloud(*cloud, idx, *cluster_cloud);
+        pcl::StatisticalOutlierRemoval<PointType_> sor;
+        sor.setInputCloud(cluster_cloud);
+        sor.setMeanK(sor_MeanK_);
+        sor.setStddevMulThresh(sor_StddevMulThresh_);
+        pcl::PointIndices::Ptr kept = arena.indices.acquire();
+        sor.filter(kept->indices);      // positions in cluster_cloud, ascending
+        for(size_t k = 0; k < kept->indices.size(); k++)
+            kept->indices[k] = idx[kept->indices[k]];
+        idx.swap(kept->indices);
+        if(DEBUG1) cout << "cluster size after statistic filter = " << idx.size() << endl;
+    }
 
-        // ************************* 6. justifying if it's the calib board ****************
-        CloudType_::Ptr boundary_registed(new CloudType_);
-        CloudType_::Ptr boundary(new CloudType_);
-        double check_time_ = 0.0;
-        pcl::console::TicToc t_check;
-        t_check.tic();
-        // is_detected_calib = isCalibBoard(filtered_plane, calib_template_, boundary_registed);
-        is_detected_calib = isCalibBoard(filtered_plane, boundary, boundary_registed);
-        check_time_ = t_check.toc();
-        // check_time_v.push_back(check_time_);
-        if(is_detected_calib)
+    // ************************* 5.1 intensity filter ***************************
+    if(use_i_filter_)
+    {
+        size_t n = 0;
+        for(size_t k = 0; k < idx.size(); k++)
         {
-            if(DEBUG1) ROS_WARN("<<<<<<<<<<<<< [LASER] Have found the calib borad point cloud!!!");
-            detectable = true;
-            pos_num ++;
-            Tr_calib2tpl_ = Tr_ukn2tpl_;
-            *detected_boards += *filtered_plane;
-            // if(DEBUG1) showPointXYZI(detected_boards,2, "positive boards");
-            pcl::copyPointCloud(*filtered_plane, *calib_board);
-            pcl::copyPointCloud(*boundary_registed, *calib_board_boundary_registed_);
-            pcl::copyPointCloud(*boundary, *calib_board_boundary_);
+            float intensity = cloud->points[idx[k]].intensity;
+            if(intensity < i_filter_out_min_ || intensity > i_filter_out_max_)     // same points as IntensityFilter()
+                idx[n++] = idx[k];
         }
-
-        // if(DEBUG1) ROS_INFO("Remianing %d points in cloud", cloud_cluster->points.size());
+        idx.resize(n);
     }
-    // if(!detectable)
-    //     ROS_WARN("<<<<<<<<<<<<< [LASER] CANNOT find the calib borad!");
-    pcl::copyPointCloud(*detected_boards, *calib_board);
-    return detectable;
+
+    check.plane = arena.clouds.acquire();
+    pcl::copyPointCloud(*cloud, idx, *check.plane);
+    check.plane_indices = pcl::IndicesPtr(plane_indices, &plane_indices->indices);  // aliases the arena buffer
+
+    // ************************* 6. justifying if it's the calib board ****************
+    checkCalibBoard(check.plane, check, arena);
 }
 
 
 void AutoDetectLaser::regionGrowSeg(CloudType_::Ptr &cloud_in_, vector<pcl::PointIndices> &clusters_, pcl::PointCloud<pcl::PointXYZRGB>::Ptr &colored_result_)
 {
-    pcl::NormalEstimation<PointType_, pcl::Normal> normEst;
-    pcl::PointCloud<pcl::Normal>::Ptr normals(new pcl::PointCloud<pcl::Normal>);
-    pcl::search::KdTree<PointType_>::Ptr tree(new pcl::search::KdTree<PointType_>);
+    pcl::NormalEstimationOMP<PointType_, pcl::Normal> normEst(pool_.size());
+    pcl::PointCloud<pcl::Normal>::Ptr& normals = rg_normals_;
+    pcl::search::KdTree<PointType_>::Ptr tree = arenas_[0].trees.get(cloud_in_);    // one build for the normals and the region growing
     normEst.setSearchMethod(tree);
     normEst.setInputCloud(cloud_in_);
     normEst.setKSearch(this->reforn_);  // number of points to search
     // normEst.setRadiusSearch(reforn_);
     normEst.compute(*normals);
+    normal_cloud_ = cloud_in_;
 
     pcl::RegionGrowing<PointType_, pcl::Normal> reg;
     reg.setMinClusterSize(cluster_size_min_);
@@ -727,101 +1316,160 @@ bool AutoDetectLaser::isCalibBoard(CloudType_::Ptr& cloud,
                 CloudType_::Ptr& cloud_boundary,
                 CloudType_::Ptr& cloud_boundary_registed)
 {
+    arenas_[0].reset();     // a standalone check is a frame of its own
+    BoardCheck check;
+    check.boundary = cloud_boundary;
+    check.boundary_registed = cloud_boundary_registed;
+    checkCalibBoard(cloud, check, arenas_[0]);
+    applyBoardCheck(check);
+    return check.is_board;
+}
+
+
+// Same test as isCalibBoard, but every result goes into check instead of the members,
+// so planes of different clusters can be checked concurrently.
+bool AutoDetectLaser::checkCalibBoard(CloudType_::Ptr& cloud, BoardCheck& check, FrameArena& arena)
+{
+    check.is_board = false;
     if(cloud->points.size() == 0)
     {
         if(DEBUG1) cerr<< "[isCalibBoard] cloud_in is empty!" << endl;
         return false;
     }
-    rmse_ukn2tpl_ = rmse_tpl2ukn_ = icp_score_ = -1.0;
-    // ******************* Voxel Filter **********************
-    // if(use_voxel_filter)
-    // {
-    //     CloudType_::Ptr cloud_filtered (new CloudType_);
-    //     pcl::VoxelGrid<PointType_> sor;
-    //     sor.setInputCloud(cloud);
-    //     sor.setLeafSize(0.01f, 0.01f, 0.01f);
-    //     sor.filter(*cloud_filtered);
-    //     if(DEBUG1) cout << "PointCloud size after filter: " << cloud_filtered->points.size() << endl;
-    //     pcl::copyPointCloud(*cloud_filtered, *cloud);
-    // }
-        
+    check.evaluated = true;
+    check.rmse_ukn2tpl = check.rmse_tpl2ukn = check.icp_score = -1.0;
+    check.pca_hypothesis = -1;
+    if(!check.boundary)             check.boundary = arena.clouds.acquire();
+    if(!check.boundary_registed)    check.boundary_registed = arena.clouds.acquire();
 
     //********************compute the PCA transform matrix*************
     pcl::console::TicToc time;
     time.tic();
     Eigen::Matrix4f PCA_Transform = Eigen::Matrix4f::Identity();
-    // PCA_Transform = PCARegistration(cloud_to_test, calib_template_);
-    PCA_Transform = PCARegistration(cloud, calib_template_);
+    PCA_Transform = PCARegistration(cloud, calib_template_, check);
     if(DEBUG2) cout << "the PCA computation spend [ " << time.toc() << "ms ]" << endl;
     if(DEBUG2) cout << "transform matrix = \n" << PCA_Transform << endl;
 
-    CloudType_::Ptr PCARegisted(new CloudType_);
-    // pcl::transformPointCloud(*cloud_to_test, *PCARegisted, PCA_Transform);
-    pcl::transformPointCloud(*cloud, *PCARegisted, PCA_Transform);
-    // for(auto p:PCARegisted->points)
-    // {
-    //     p.z = 0.0;
-    // }
-    pcl::copyPointCloud(*PCARegisted, *pca_regist_pc_);
-
-
     //****************** extract boundary **************
-    CloudType_::Ptr PCARegisted_boundary(new CloudType_);
-    pcl::PointCloud<pcl::Boundary>::Ptr boundaries (new pcl::PointCloud<pcl::Boundary>);   //储存边界估计结果
+    // invariant to the rigid transform: estimated once on the input, shared by all PCA hypotheses
+    pcl::PointCloud<pcl::Boundary>::Ptr boundaries = arena.boundaries.acquire();   //储存边界估计结果
     pcl::console::TicToc tt;
     tt.tic();
 
-    this->estimateBorders(PCARegisted, boundaries);
+    if(use_grid_boundary_)
+        this->estimateBordersGrid(cloud, check.C_source.head<3>(), check.U_source.col(2), check.U_source.col(1), boundaries);   // the in-plane PCA axes
+    else if(cachedNormalsValid(check.plane_indices))
+        this->estimateBorders(normal_cloud_, check.plane_indices, rg_normals_, boundaries, arena.trees.get(normal_cloud_, check.plane_indices));
+    else
+        this->estimateBorders(cloud, boundaries, arena.trees.get(cloud));
     if(DEBUG2) std::cout << "estimateBorders spend [ " << tt.toc() << " ms ]" << std::endl;
+    check.boundary->clear();
     for(auto p = boundaries->begin(); p < boundaries->end(); p++)
     {
-        if(p->boundary_point > 0)   PCARegisted_boundary->push_back(PCARegisted->points[p-boundaries->begin()]);
+        if(p->boundary_point > 0)   check.boundary->push_back(cloud->points[p-boundaries->begin()]);
     }
-    if(DEBUG1) cout << "size of boudary: " << PCARegisted_boundary->points.size() << endl;
-    if(PCARegisted_boundary->points.size() <= 3)
+    if(DEBUG1) cout << "size of boudary: " << check.boundary->points.size() << endl;
+    if(check.boundary->points.size() <= 3)
     {
         if(DEBUG1) ROS_WARN("This plane is invalid");
         return false;
     }
-    // pcl::transformPointCloud(*PCARegisted_boundary, *cloud_boundary_registed, PCA_Transform.inverse());
-    pcl::copyPointCloud(*PCARegisted_boundary, *pca_regist_boundary_);
-    pcl::transformPointCloud(*PCARegisted_boundary, *cloud_boundary, PCA_Transform.inverse());
+
+    //****************** warm start from the tracked board **************
+    bool warm_started = false;
+    if(warm_start_)
+    {
+        // the same test that ends the PCA hypothesis search
+        float rmse, rmse_tpl;
+        scorePCAHypothesis(*check.boundary, *arena.trees.get(check.boundary), track_Tr_, rmse, rmse_tpl);
+        if(passesDifference(rmse, rmse_tpl))
+        {
+            PCA_Transform = track_Tr_;
+            warm_started = true;
+            if(DEBUG2) cout << "Registration warm-started from the tracked transform" << endl;
+        }
+    }
+
+    //****************** PCA hypotheses **************
+    if(use_pca_hypotheses_ && !warm_started)
+    {
+        time.tic();
+        selectPCAHypothesis(check.boundary, check, PCA_Transform, arena);
+        if(DEBUG2) cout << "PCA hypothesis " << check.pca_hypothesis << " selected in [ " << time.toc() << "ms ]" << endl;
+    }
+
+    CloudType_::Ptr PCARegisted_boundary = arena.clouds.acquire();
+    pcl::transformPointCloud(*check.boundary, *PCARegisted_boundary, PCA_Transform);
+    if(capture(CAPTURE_PCA_REGIST_PC))
+    {
+        CloudType_::Ptr PCARegisted = arena.clouds.acquire();
+        pcl::transformPointCloud(*cloud, *PCARegisted, PCA_Transform);
+        check.pca_regist_pc = PCARegisted;
+    }
+    if(capture(CAPTURE_PCA_REGIST_BOUNDARY))
+        check.pca_regist_boundary = PCARegisted_boundary;
 
     //****************** ICP *****************
+    // After PCA the candidate lies in the template plane, so by default only the in-plane motion is solved.
     pcl::console::TicToc time2;
     time2.tic();
-    pcl::IterativeClosestPoint<PointType_, PointType_> icp;
-    icp.setInputSource(PCARegisted_boundary);
-    icp.setInputTarget(calib_template_);
-    icp.setTransformationEpsilon(1e-10);
-    icp.setMaxCorrespondenceDistance(1);
-    icp.setEuclideanFitnessEpsilon(0.01);
-    icp.setMaximumIterations(100);
-    icp.setUseReciprocalCorrespondences(true);
-    CloudType_::Ptr icp_cloud(new CloudType_);
-    icp.align(*icp_cloud);
-    if (icp.hasConverged()) 
+    CloudType_::Ptr icp_cloud = arena.clouds.acquire();
+    Eigen::Matrix4f Tr_regist = Eigen::Matrix4f::Identity();
+    bool regist_converged = false;
+    int regist_iter = 0;
+    if(regist_method_ == REGIST_PLANAR && template_df_.valid())
+    {
+        double fitness = -1.0;
+        regist_converged = planar_regist_.align(*PCARegisted_boundary, *icp_cloud, Tr_regist, fitness, &regist_iter);
+        check.icp_score = fitness;
+    }
+    // full ICP: selected, as a fallback when the planar solve fails, or as a short polish after it
+    if(!regist_converged || planar_polish_iter_ > 0)
+    {
+        bool polish = regist_converged;
+        pcl::IterativeClosestPoint<PointType_, PointType_> icp;
+        icp.setInputSource(PCARegisted_boundary);
+        icp.setInputTarget(calib_template_);
+        icp.setSearchMethodTarget(template_search_, true);  // the template tree is built once, in setCalibTemplate()
+        icp.setTransformationEpsilon(1e-10);
+        icp.setMaxCorrespondenceDistance(1);
+        icp.setEuclideanFitnessEpsilon(0.01);
+        icp.setMaximumIterations(polish ? planar_polish_iter_ : 100);
+        icp.setUseReciprocalCorrespondences(true);
+        if(polish)
+            icp.align(*icp_cloud, Tr_regist);
+        else
+            icp.align(*icp_cloud);
+        regist_converged = icp.hasConverged();
+        regist_iter += polish ? planar_polish_iter_ : 100;
+        if(regist_converged)
+        {
+            Tr_regist = icp.getFinalTransformation();
+            check.icp_score = icp.getFitnessScore();
+        }
+    }
+    if (regist_converged) 
     {
         if(DEBUG1) ROS_INFO("ICP has converged!");
-        icp_score_ = icp.getFitnessScore();
-        if(DEBUG1) cout << "\nICP has converged, score is " << icp_score_ << endl;
-        
-        Tr_ukn2tpl_ = icp.getFinalTransformation() * PCA_Transform;
+        if(DEBUG1) cout << "\nICP has converged, score is " << check.icp_score << endl;
         
+        check.Tr_ukn2tpl = Tr_regist * PCA_Transform;
+        check.tr_valid = true;
     }
     else 
     {
         if(DEBUG1)ROS_WARN("ICP hasn't converged!");
-        icp_score_ = -1.0;
+        check.icp_score = -1.0;
     }
-    if(DEBUG2) cout << "Applied " << 100 << " ICP iterations in [ " << time2.toc() << " ms ]" << endl;
+    if(DEBUG2) cout << "Applied " << regist_iter << " registration iterations in [ " << time2.toc() << " ms ]" << endl;
     if(DEBUG2)   
     {
-        cout << "ICP Transformation: \n" << icp.getFinalTransformation() << endl;
-        cout << "The final TR =\n" << Tr_ukn2tpl_ << endl;
+        cout << "ICP Transformation: \n" << Tr_regist << endl;
+        cout << "The final TR =\n" << check.Tr_ukn2tpl << endl;
     }       
-    pcl::copyPointCloud(*icp_cloud, *cloud_boundary_registed);
-    pcl::copyPointCloud(*icp_cloud, *icp_regist_boundary_);
+    pcl::copyPointCloud(*icp_cloud, *check.boundary_registed);
+    if(capture(CAPTURE_ICP_REGIST_BOUNDARY))
+        check.icp_regist_boundary = icp_cloud;
     
 
     // ************************* difference assesment *************************
@@ -831,10 +1479,9 @@ bool AutoDetectLaser::isCalibBoard(CloudType_::Ptr& cloud,
         cout << "size of template: " << calib_template_->points.size() << endl; 
     }
     float rmse_ukn2tpl, rmse_tpl2ukn, rmse_mean;
-    rmse_ukn2tpl = ComputeDifference(icp_cloud, calib_template_);
-    rmse_tpl2ukn = ComputeDifference(calib_template_, icp_cloud);
-    rmse_ukn2tpl_ = rmse_ukn2tpl;
-    rmse_tpl2ukn_ = rmse_tpl2ukn;
+    bool diff_passed = verifyDifference(icp_cloud, rmse_ukn2tpl, rmse_tpl2ukn, arena);
+    check.rmse_ukn2tpl = rmse_ukn2tpl;
+    check.rmse_tpl2ukn = rmse_tpl2ukn;
     rmse_mean = (rmse_ukn2tpl + rmse_tpl2ukn) / (float)2;
     if(DEBUG1)
     {
@@ -844,32 +1491,56 @@ bool AutoDetectLaser::isCalibBoard(CloudType_::Ptr& cloud,
     }
 
     #ifdef STATIC_ANALYSE
-    // visualize_regist(cloud_boundary_registed, calib_template_, icp_cloud);
-    // showPointXYZI(cloud, 2, "Unknown Plane");
-    visualize_regist(calib_template_, PCARegisted_boundary, C_target, U_target, 2, "PCA Registration Result");
-    visualize_regist(calib_template_, icp_cloud, C_target, U_target, rmse_ukn2tpl, rmse_tpl2ukn, 2, "ICP Registration Result");
+    visualize_regist(calib_template_, PCARegisted_boundary, check.C_target, check.U_target, 2, "PCA Registration Result");
+    visualize_regist(calib_template_, icp_cloud, check.C_target, check.U_target, rmse_ukn2tpl, rmse_tpl2ukn, 2, "ICP Registration Result");
     #endif
 
-    if(rmse_ukn2tpl <= rmse_ukn2tpl_thre_ && rmse_tpl2ukn <= rmse_tpl2ukn_thre_)
-        return true;
-    else
-        return false;
-
-     
-    // visualize_regist(cloud_boundary_registed, calib_template_, icp_cloud);
-
+    check.is_board = diff_passed && passesDifference(rmse_ukn2tpl, rmse_tpl2ukn);
+    return check.is_board;
 }
 
 
+// Publish one check result into the members (scores, transforms and debug clouds),
+// leaving untouched whatever the check did not reach, as the old in-place isCalibBoard did.
+// The clouds of a check live in a frame arena, so they are copied, never shared.
+void AutoDetectLaser::applyBoardCheck(const BoardCheck& check, bool with_clouds)
+{
+    if(!check.evaluated)
+        return;
+    rmse_ukn2tpl_ = check.rmse_ukn2tpl;
+    rmse_tpl2ukn_ = check.rmse_tpl2ukn;
+    icp_score_ = check.icp_score;
+    C_source = check.C_source;  C_target = check.C_target;
+    U_source = check.U_source;  U_target = check.U_target;
+    lamda_source = check.lamda_source;  lamda_target = check.lamda_target;
+    if(check.tr_valid)              Tr_ukn2tpl_ = check.Tr_ukn2tpl;
+    if(!with_clouds)
+        return;
+    if(check.pca_regist_pc)         pcl::copyPointCloud(*check.pca_regist_pc, *pca_regist_pc_);
+    if(check.pca_regist_boundary)   pcl::copyPointCloud(*check.pca_regist_boundary, *pca_regist_boundary_);
+    if(check.icp_regist_boundary)   pcl::copyPointCloud(*check.icp_regist_boundary, *icp_regist_boundary_);
+}
 
 
+Eigen::Matrix4f AutoDetectLaser::PCARegistration(CloudType_::Ptr& source_cloud, CloudType_::Ptr& target_cloud)
+{
+    BoardCheck check;
+    Eigen::Matrix4f final_TR = PCARegistration(source_cloud, target_cloud, check);
+    C_source = check.C_source;  C_target = check.C_target;
+    U_source = check.U_source;  U_target = check.U_target;
+    lamda_source = check.lamda_source;  lamda_target = check.lamda_target;
+    return final_TR;
+}
 
 
-Eigen::Matrix4f AutoDetectLaser::PCARegistration(CloudType_::Ptr& source_cloud, CloudType_::Ptr& target_cloud)
+Eigen::Matrix4f AutoDetectLaser::PCARegistration(CloudType_::Ptr& source_cloud, CloudType_::Ptr& target_cloud, BoardCheck& check)
 {
-    // Eigen::Vector4f C_source, C_target;  // Centroid
-    // Eigen::Matrix3f U_source, U_target;  // Eiegnvectors
-    // Eigen::Vector3f lamda_source, lamda_target;    // Eiegnvalues
+    Eigen::Vector4f& C_source = check.C_source;
+    Eigen::Vector4f& C_target = check.C_target;
+    Eigen::Matrix3f& U_source = check.U_source;
+    Eigen::Matrix3f& U_target = check.U_target;
+    Eigen::Vector3f& lamda_source = check.lamda_source;
+    Eigen::Vector3f& lamda_target = check.lamda_target;
 
     ComputeEigenVectorPCA(source_cloud, C_source, U_source, lamda_source);
     ComputeEigenVectorPCA(target_cloud, C_target, U_target, lamda_target);
@@ -904,11 +1575,131 @@ Eigen::Matrix4f AutoDetectLaser::PCARegistration(CloudType_::Ptr& source_cloud,
 }
 
 
-float AutoDetectLaser::CalculateRMSE(std::vector<float> data)
+// The eigenvectors behind PCARegistration() are only defined up to sign, and the two in-plane axes swap
+// when their eigenvalues are close, so R0 = U_target * U_source^-1 can leave the candidate flipped or turned
+// by 90 deg, a basin the registration does not get out of. Every proper rotation these ambiguities allow is
+// scored against the template in parallel. The first hypothesis (in order, the raw basis first) that already
+// passes both rmse gates stops the search; if none does, the smallest mean squared distance wins.
+int AutoDetectLaser::selectPCAHypothesis(CloudType_::Ptr& boundary, BoardCheck& check, Eigen::Matrix4f& PCA_Transform, FrameArena& arena)
+{
+    pcl::search::KdTree<PointType_>::Ptr boundary_tree = arena.trees.get(boundary);   // built before the parallel scoring
+    const Eigen::Matrix3f U_source_inv = check.U_source.inverse();
+    vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> >& hyps = arena.transforms;
+    hyps.clear();
+    for(int swap = 0; swap < 2; swap++)
+    {
+        for(int k = 0; k < 8; k++)
+        {
+            // column j: where source axis j goes (axis 0 is the plane normal)
+            Eigen::Matrix3f M = Eigen::Matrix3f::Zero();
+            M(0, 0) = (k & 1) ? -1 : 1;
+            M(swap ? 2 : 1, 1) = (k & 2) ? -1 : 1;
+            M(swap ? 1 : 2, 2) = (k & 4) ? -1 : 1;
+            Eigen::Matrix3f R = check.U_target * M * U_source_inv;
+            if(R.determinant() < 0)     continue;
+            Eigen::Matrix4f TR = Eigen::Matrix4f::Identity();
+            TR.block<3, 3>(0, 0) = R;
+            TR.block<3, 1>(0, 3) = check.C_target.head<3>() - R * check.C_source.head<3>();
+            hyps.push_back(TR);
+        }
+    }
+
+    const int n = hyps.size();
+    arena.scores.assign(3 * n, FLT_MAX);
+    float* score = arena.scores.data();
+    float* rmse = score + n;
+    float* rmse_tpl = score + 2 * n;
+    atomic<int> first_pass(n);
+    pool_.parallelFor(n, [&](int i, int worker)
+    {
+        // hypotheses before the first passing one always run, so the choice does not depend on timing
+        if(i > first_pass.load())   return;
+        score[i] = scorePCAHypothesis(*boundary, *boundary_tree, hyps[i], rmse[i], rmse_tpl[i]);
+        if(passesDifference(rmse[i], rmse_tpl[i]))
+        {
+            int cur = first_pass.load();
+            while(i < cur && !first_pass.compare_exchange_weak(cur, i));
+        }
+    });
+    int best = first_pass.load();
+    if(best == n)
+    {
+        best = 0;
+        for(int i = 1; i < n; i++)
+        {
+            if(score[i] < score[best])  best = i;
+        }
+    }
+    if(DEBUG2)
+    {
+        for(int i = 0; i < n; i++)
+            cout << "PCA hypothesis " << i << ": score = " << score[i] << ", rmse = " << rmse[i] << " / " << rmse_tpl[i] << endl;
+    }
+    PCA_Transform = hyps[best];
+    check.pca_hypothesis = best;
+    return best;
+}
+
+
+// Mean squared template distance of the transformed boundary (subsampled to about hyp_score_points_ points).
+// rmse_ukn2tpl and rmse_tpl2ukn get the deviations of the distances in both directions, the measures of the
+// accept gate (see passesDifference()). The template points are taken into the frame of the boundary instead
+// of the other way round, so boundary_tree serves every hypothesis.
+float AutoDetectLaser::scorePCAHypothesis(const CloudType_& boundary, pcl::search::KdTree<PointType_>& boundary_tree, const Eigen::Matrix4f& TR,
+                                          float& rmse_ukn2tpl, float& rmse_tpl2ukn)
+{
+    static thread_local std::vector<int> pointIdxKNNSearch(1);
+    static thread_local std::vector<float> pointKNNSquareDistance(1);
+    const size_t step = max<size_t>(1, boundary.points.size() / hyp_score_points_);
+    const bool use_df = use_template_df_ && template_df_.valid();
+    double sum = 0.0, sum_sqr = 0.0;
+    int cnt = 0;
+    for(size_t i = 0; i < boundary.points.size(); i += step)
+    {
+        PointType_ p = boundary.points[i];
+        p.getVector3fMap() = TR.block<3, 3>(0, 0) * p.getVector3fMap() + TR.block<3, 1>(0, 3);
+        float sqr_dis;
+        if(use_df)
+            sqr_dis = template_df_.nearestSqrDistance(p);
+        else if(template_kdtree_->nearestKSearch(p, 1, pointIdxKNNSearch, pointKNNSquareDistance) > 0)
+            sqr_dis = pointKNNSquareDistance[0];
+        else
+            continue;
+        sum += sqrt(sqr_dis);
+        sum_sqr += sqr_dis;
+        cnt++;
+    }
+    rmse_tpl2ukn = FLT_MAX;
+    if(cnt == 0)
+    {
+        rmse_ukn2tpl = FLT_MAX;
+        return FLT_MAX;
+    }
+    double mean = sum / cnt;
+    rmse_ukn2tpl = sqrt(max(0.0, sum_sqr / cnt - mean * mean));
+
+    const Eigen::Matrix3f R_inv = TR.block<3, 3>(0, 0).transpose();
+    const Eigen::Vector3f t = TR.block<3, 1>(0, 3);
+    const size_t tpl_step = max<size_t>(1, calib_template_->points.size() / hyp_score_points_);
+    StreamingDeviation dev;
+    for(size_t i = 0; i < calib_template_->points.size(); i += tpl_step)
+    {
+        PointType_ p = calib_template_->points[i];
+        p.getVector3fMap() = R_inv * (p.getVector3fMap() - t);
+        if(boundary_tree.nearestKSearch(p, 1, pointIdxKNNSearch, pointKNNSquareDistance) > 0)
+            dev.add(sqrt(pointKNNSquareDistance[0]));
+    }
+    if(dev.count() > 0)
+        rmse_tpl2ukn = dev.deviation();
+    return sum_sqr / cnt;
+}
+
+
+float AutoDetectLaser::CalculateRMSE(const std::vector<float>& data)
 {
     int N = data.size();
     float rmse = 0, mean = 0, sum = 0;
-    for(auto p:data)
+    for(auto& p:data)
     {
         sum += p;
     }
@@ -916,7 +1707,7 @@ float AutoDetectLaser::CalculateRMSE(std::vector<float> data)
     if(DEBUG1) cout << "the mean is " << mean << endl;
 
     sum = 0;
-    for(auto p:data)
+    for(auto& p:data)
     {
         sum += pow(p - mean, 2);
     }
@@ -926,18 +1717,20 @@ float AutoDetectLaser::CalculateRMSE(std::vector<float> data)
 }
 
 
-float AutoDetectLaser::ComputeDifference(CloudType_::Ptr& source, CloudType_::Ptr& target)
+float AutoDetectLaser::ComputeDifference(CloudType_::Ptr& source, CloudType_::Ptr& target, FrameArena& arena)
 {
-    std::vector<float> distance;
-    pcl::KdTreeFLANN<PointType_> kdtree;
-    kdtree.setInputCloud(target);
+    // per-thread scratch, keeps its capacity between calls
+    static thread_local std::vector<float> distance;
+    static thread_local std::vector<int> pointIdxKNNSearch(1);          // 保存近邻点的索引
+    static thread_local std::vector<float> pointKNNSquareDistance(1);   // 保存每个近邻点与查找点之间的欧式距离平方
+    distance.clear();
+    distance.reserve(source->points.size());
+    pcl::search::KdTree<PointType_>::Ptr kdtree = arena.trees.get(target);
     for(auto p = source->begin(); p < source->end(); p++)
     {
-        PointType_ searchPoint = *p;
-        std::vector<int> pointIdxKNNSearch(1);          // 保存近邻点的索引
-        std::vector<float> pointKNNSquareDistance(1);   // 保存每个近邻点与查找点之间的欧式距离平方
+        const PointType_& searchPoint = *p;
 
-        if(kdtree.nearestKSearch(searchPoint, 1, pointIdxKNNSearch, pointKNNSquareDistance))
+        if(kdtree->nearestKSearch(searchPoint, 1, pointIdxKNNSearch, pointKNNSquareDistance))
         {
             // if(DEBUG1)   cout << p - source->begin() << ". " << "for point: " << searchPoint.x << " " << searchPoint.y << " " << searchPoint.z << endl;
             for(auto i = pointIdxKNNSearch.begin(); i < pointIdxKNNSearch.end(); i++)
@@ -961,6 +1754,102 @@ float AutoDetectLaser::ComputeDifference(CloudType_::Ptr& source, CloudType_::Pt
 
 
 
+// Same as ComputeDifference(source, calib_template_), on the cached template KD-tree, nothing is built per call.
+// This feeds the accept gate, so the distances are exact: the distance field is only used for scoring and registration.
+float AutoDetectLaser::ComputeDifferenceToTemplate(CloudType_::Ptr& source)
+{
+    static thread_local std::vector<float> distance;
+    static thread_local std::vector<int> pointIdxKNNSearch(1);
+    static thread_local std::vector<float> pointKNNSquareDistance(1);
+    distance.clear();
+    distance.reserve(source->points.size());
+    for(auto p = source->begin(); p < source->end(); p++)
+    {
+        if(template_kdtree_->nearestKSearch(*p, 1, pointIdxKNNSearch, pointKNNSquareDistance))
+            distance.push_back(sqrt(pointKNNSquareDistance[0]));
+    }
+    if(DEBUG2) cout << "distance vector size = " << distance.size() << endl;
+    return CalculateRMSE(distance);
+}
+
+
+// Both directions of the template difference, run concurrently on the pool (inline, cheap direction first,
+// when called from a cluster task). Each streams its deviation and gives up as soon as it can no longer
+// pass its threshold, which also stops the other one. A direction that gave up reports its lower bound
+// (above the threshold), one stopped by the other reports -1.
+bool AutoDetectLaser::verifyDifference(CloudType_::Ptr& cloud, float& rmse_ukn2tpl, float& rmse_tpl2ukn, FrameArena& arena)
+{
+    pcl::search::KdTree<PointType_>::Ptr cloud_tree = arena.trees.get(cloud);  // from the calling worker's arena, before the fork
+    const float thre_ukn2tpl = verify_early_abort_ ? rmse_ukn2tpl_thre_ : FLT_MAX;
+    const float thre_tpl2ukn = verify_early_abort_ ? rmse_tpl2ukn_thre_ : FLT_MAX;
+    atomic<bool> abort(false);
+    pool_.parallelFor(2, [&](int i, int worker)
+    {
+        if(i == 0)
+            rmse_ukn2tpl = streamDifferenceToTemplate(cloud, thre_ukn2tpl, abort);
+        else
+            rmse_tpl2ukn = streamDifference(calib_template_, *cloud_tree, thre_tpl2ukn, abort);
+    });
+    return !abort.load();
+}
+
+
+// ComputeDifference() without the distance vector: the deviation is accumulated while searching.
+// Returns its lower bound as soon as it is certain to exceed thre (and raises abort), -1 if abort was raised elsewhere.
+float AutoDetectLaser::streamDifference(CloudType_::Ptr& source, const pcl::search::KdTree<PointType_>& target_tree, float thre, atomic<bool>& abort)
+{
+    static thread_local std::vector<int> pointIdxKNNSearch(1);
+    static thread_local std::vector<float> pointKNNSquareDistance(1);
+    if(abort.load())    return -1.0;
+    const size_t n = source->points.size();
+    StreamingDeviation dev;
+    for(size_t i = 0; i < n; i++)
+    {
+        if(target_tree.nearestKSearch(source->points[i], 1, pointIdxKNNSearch, pointKNNSquareDistance))
+            dev.add(sqrt(pointKNNSquareDistance[0]));
+        if((i & 15) == 15)
+        {
+            if(abort.load(memory_order_relaxed))    return -1.0;
+            if(dev.exceeds(thre, n))
+            {
+                abort = true;
+                return dev.lowerBound(n);
+            }
+        }
+    }
+    if(dev.deviation() > thre)  abort = true;
+    return dev.deviation();
+}
+
+
+// As streamDifference(source, calib_template_), on the cached template KD-tree. The distance field is not
+// exact, and this is the accept gate, see ComputeDifferenceToTemplate().
+float AutoDetectLaser::streamDifferenceToTemplate(CloudType_::Ptr& source, float thre, atomic<bool>& abort)
+{
+    static thread_local std::vector<int> pointIdxKNNSearch(1);
+    static thread_local std::vector<float> pointKNNSquareDistance(1);
+    if(abort.load())    return -1.0;
+    const size_t n = source->points.size();
+    StreamingDeviation dev;
+    for(size_t i = 0; i < n; i++)
+    {
+        if(template_kdtree_->nearestKSearch(source->points[i], 1, pointIdxKNNSearch, pointKNNSquareDistance))
+            dev.add(sqrt(pointKNNSquareDistance[0]));
+        if((i & 15) == 15)
+        {
+            if(abort.load(memory_order_relaxed))    return -1.0;
+            if(dev.exceeds(thre, n))
+            {
+                abort = true;
+                return dev.lowerBound(n);
+            }
+        }
+    }
+    if(dev.deviation() > thre)  abort = true;
+    return dev.deviation();
+}
+
+
 void AutoDetectLaser::RemoveFloor(CloudType_::Ptr& cloud_in, CloudType_::Ptr& cloud_out, float part)
 {
     PointType_ min;
@@ -983,6 +1872,14 @@ void AutoDetectLaser::RemoveFloor(CloudType_::Ptr& cloud_in, CloudType_::Ptr& cl
 
 
 CloudType_::Ptr AutoDetectLaser::IntensityFilter(CloudType_::Ptr& cloud_in, float rm_range_min, float rm_range_max)
+{
+    CloudType_::Ptr filtered_cloud (new CloudType_);
+    IntensityFilter(cloud_in, *filtered_cloud, rm_range_min, rm_range_max);
+    return filtered_cloud;
+}
+
+
+void AutoDetectLaser::IntensityFilter(CloudType_::Ptr& cloud_in, CloudType_& filtered_cloud, float rm_range_min, float rm_range_max)
 {
     // vector<float> v_intensity;
     // for(auto p:cloud_in->points)
@@ -997,7 +1894,6 @@ CloudType_::Ptr AutoDetectLaser::IntensityFilter(CloudType_::Ptr& cloud_in, floa
     //     cout << "the max intensity: " << max_i << "\t the min intensity: " << min_i << endl;
     // } 
 
-    CloudType_::Ptr filtered_cloud (new CloudType_);
     pcl::PassThrough<PointType_> pass;
     // float min_to_rm = min_i + remove_part * (max_i - min_i), max_to_rm = max_i;
     float min_to_rm = rm_range_min, max_to_rm = rm_range_max;
@@ -1006,18 +1902,102 @@ CloudType_::Ptr AutoDetectLaser::IntensityFilter(CloudType_::Ptr& cloud_in, floa
     pass.setFilterLimits(min_to_rm, max_to_rm);
     pass.setNegative(true);
     pass.setInputCloud(cloud_in);
-    pass.filter(*filtered_cloud);
+    pass.filter(filtered_cloud);
     if(DEBUG1)
     {
         cout << "min_to_rm: " << min_to_rm << "\t" << "max_to_rm: " << max_to_rm << endl;
-        cout << "size after intensity filter: " << filtered_cloud->size() << endl;
+        cout << "size after intensity filter: " << filtered_cloud.size() << endl;
     }
-    
-    
-    return filtered_cloud;
 }
 
 
+void AutoDetectLaser::hashVoxelDownsample(CloudType_::Ptr& cloud_in, CloudType_::Ptr& cloud_out, double leaf_size)
+{
+    voxel_hash_.reset(leaf_size);
+    voxel_hash_.reserve(cloud_in->points.size() / 4);
+    for(auto p = cloud_in->points.begin(); p < cloud_in->points.end(); p++)
+    {
+        if(!std::isfinite(p->x) || !std::isfinite(p->y) || !std::isfinite(p->z))
+            continue;
+        voxel_hash_.addPoint(p->x, p->y, p->z, p->intensity);
+    }
+    voxel_hash_.getCentroids(*cloud_out);
+    if(DEBUG1) cout << "[hashVoxelDownsample] " << cloud_in->points.size() << " -> " << cloud_out->points.size() << " points" << endl;
+}
+
+
+// x-gate, intensity gate and voxel-leaf assignment fused into one pass over cloud_in.
+// The cloud is walked in chunks that are transposed into SoA scratch buffers, so the gate
+// loop is branch-free over contiguous floats and vectorizes; survivors go straight into the voxel hash.
+void AutoDetectLaser::fusedPrefilter(CloudType_::Ptr& cloud_in, CloudType_::Ptr& cloud_out, bool use_i_gate)
+{
+    const size_t n = cloud_in->points.size();
+    const float x_min = remove_x_min_, x_max = remove_x_max_;
+    const float i_min = i_filter_out_min_, i_max = i_filter_out_max_;
+    const uint8_t i_gate_off = use_i_gate ? 0 : 1;
+
+    soa_x_.resize(PREFILTER_CHUNK);
+    soa_y_.resize(PREFILTER_CHUNK);
+    soa_z_.resize(PREFILTER_CHUNK);
+    soa_i_.resize(PREFILTER_CHUNK);
+    x_keep_.resize(PREFILTER_CHUNK);
+    keep_.resize(PREFILTER_CHUNK);
+    float *xs = soa_x_.data(), *ys = soa_y_.data(), *zs = soa_z_.data(), *is = soa_i_.data();
+    uint8_t *x_keep = x_keep_.data(), *keep = keep_.data();
+    const bool keep_x_filtered = capture(CAPTURE_X_FILTERED);
+
+    x_filtered_->clear();
+    cloud_out->clear();
+    if(use_vox_filter_)
+    {
+        voxel_hash_.reset(voxel_grid_size_);
+        voxel_hash_.reserve(n / 4);
+    }
+    else
+        cloud_out->reserve(n);
+
+    const PointType_* pts = cloud_in->points.data();
+    for(size_t base = 0; base < n; base += PREFILTER_CHUNK)
+    {
+        const size_t m = std::min((size_t)PREFILTER_CHUNK, n - base);
+        for(size_t k = 0; k < m; k++)
+        {
+            xs[k] = pts[base + k].x;
+            ys[k] = pts[base + k].y;
+            zs[k] = pts[base + k].z;
+            is[k] = pts[base + k].intensity;
+        }
+        for(size_t k = 0; k < m; k++)
+        {
+            // fabs(v) <= FLT_MAX is false for NaN and Inf
+            uint8_t finite = (std::fabs(xs[k]) <= FLT_MAX) & (std::fabs(ys[k]) <= FLT_MAX) & (std::fabs(zs[k]) <= FLT_MAX);
+            uint8_t x_out = (xs[k] < x_min) | (xs[k] > x_max);
+            uint8_t i_out = (is[k] < i_min) | (is[k] > i_max) | i_gate_off;
+            x_keep[k] = finite & x_out;
+            keep[k] = finite & x_out & i_out;
+        }
+        for(size_t k = 0; k < m; k++)
+        {
+            if(keep_x_filtered && x_keep[k])    x_filtered_->points.push_back(pts[base + k]);
+            if(!keep[k])    continue;
+            if(use_vox_filter_)
+                voxel_hash_.addPoint(xs[k], ys[k], zs[k], is[k]);
+            else
+                cloud_out->points.push_back(pts[base + k]);
+        }
+    }
+    x_filtered_->width = x_filtered_->points.size();
+    x_filtered_->height = 1;
+
+    if(use_vox_filter_)
+        voxel_hash_.getCentroids(*cloud_out);
+    else
+    {
+        cloud_out->width = cloud_out->points.size();
+        cloud_out->height = 1;
+        cloud_out->is_dense = true;
+    }
+}
 
 
 
@@ -0,0 +1,144 @@
+#ifndef BackgroundModel_H
+#define BackgroundModel_H
+
+#include <vector>
+#include <cmath>
+#include <string>
+#include <fstream>
+#include <unordered_map>
+#include <pcl/point_cloud.h>
+#include "VoxelHash.h"
+
+using namespace std;
+
+// Occupancy voxel map of the static scene.
+// learn() is fed frames of the empty scene; a voxel is background if it was hit in at least min_occupancy_
+// of them, so single noisy returns do not mask anything. subtract() then keeps only the points of a frame
+// that fall in non-background voxels, i.e. the board and whoever carries it.
+// The map is stored as text: a header line "lvt2calib_background <leaf size> <frames> <voxels>" followed by
+// one "<x> <y> <z> <hits>" voxel key per line.
+class BackgroundModel
+{
+    private:
+        struct VoxelHits
+        {
+            int hits, last_frame;
+        };
+
+        double leaf_size_ = 0.1, inv_leaf_ = 10.0;
+        double min_occupancy_ = 0.1;
+        int frames_ = 0;
+        unordered_map<VoxelKey, VoxelHits, VoxelKeyHash> voxels_;
+
+        int minHits() const { return max(1, (int)ceil(min_occupancy_ * frames_)); }
+
+    public:
+        BackgroundModel(){};
+        ~BackgroundModel(){};
+
+        // changing the leaf size drops the learned map
+        void setLeafSize(double leaf_size)
+        {
+            leaf_size_ = leaf_size;
+            inv_leaf_ = 1.0 / leaf_size;
+            clear();
+        }
+        void setMinOccupancy(double ratio) { min_occupancy_ = ratio; }
+        void clear()
+        {
+            voxels_.clear();
+            frames_ = 0;
+        }
+        int frames() const { return frames_; }
+        size_t size() const { return voxels_.size(); }
+        bool valid() const { return frames_ > 0; }
+
+        // one frame of the empty scene, every voxel is counted once per frame
+        template<typename PointT>
+        void learn(const pcl::PointCloud<PointT>& cloud)
+        {
+            voxels_.reserve(voxels_.size() + cloud.points.size() / 4);
+            for(const PointT& p : cloud.points)
+            {
+                if(!isfinite(p.x) || !isfinite(p.y) || !isfinite(p.z))
+                    continue;
+                auto res = voxels_.emplace(getVoxelKey(p.x, p.y, p.z, inv_leaf_), VoxelHits{0, -1});
+                VoxelHits& v = res.first->second;
+                if(v.last_frame != frames_)
+                {
+                    v.hits++;
+                    v.last_frame = frames_;
+                }
+            }
+            frames_++;
+        }
+
+        template<typename PointT>
+        bool isBackground(const PointT& p) const
+        {
+            auto it = voxels_.find(getVoxelKey(p.x, p.y, p.z, inv_leaf_));
+            return it != voxels_.end() && it->second.hits >= minHits();
+        }
+
+        // cloud_out: the points of cloud_in outside the background (cloud_out must not be cloud_in)
+        template<typename PointT>
+        void subtract(const pcl::PointCloud<PointT>& cloud_in, pcl::PointCloud<PointT>& cloud_out) const
+        {
+            const int min_hits = minHits();
+            cloud_out.clear();
+            cloud_out.header = cloud_in.header;
+            for(const PointT& p : cloud_in.points)
+            {
+                if(!isfinite(p.x) || !isfinite(p.y) || !isfinite(p.z))
+                    continue;
+                auto it = voxels_.find(getVoxelKey(p.x, p.y, p.z, inv_leaf_));
+                if(it == voxels_.end() || it->second.hits < min_hits)
+                    cloud_out.points.push_back(p);
+            }
+            cloud_out.width = cloud_out.points.size();
+            cloud_out.height = 1;
+            cloud_out.is_dense = true;
+        }
+
+        bool save(const string& path) const
+        {
+            ofstream file(path.c_str());
+            if(!file.is_open())
+                return false;
+            file.precision(17);
+            file << "lvt2calib_background " << leaf_size_ << " " << frames_ << " " << voxels_.size() << "\n";
+            for(const auto& v : voxels_)
+                file << v.first.x << " " << v.first.y << " " << v.first.z << " " << v.second.hits << "\n";
+            return file.good();
+        }
+        // the leaf size is taken from the file
+        bool load(const string& path)
+        {
+            ifstream file(path.c_str());
+            if(!file.is_open())
+                return false;
+            string tag;
+            double leaf_size;
+            int frames;
+            size_t n;
+            if(!(file >> tag >> leaf_size >> frames >> n) || tag != "lvt2calib_background" || leaf_size <= 0)
+                return false;
+            setLeafSize(leaf_size);
+            voxels_.reserve(n);
+            for(size_t i = 0; i < n; i++)
+            {
+                VoxelKey k;
+                int hits;
+                if(!(file >> k.x >> k.y >> k.z >> hits))
+                {
+                    clear();
+                    return false;
+                }
+                voxels_[k] = VoxelHits{hits, -1};
+            }
+            frames_ = frames;
+            return true;
+        }
+};
+
+#endif
@@ -0,0 +1,523 @@
+#ifndef CircleDetection_H
+#define CircleDetection_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include <Eigen/Dense>
+
+using namespace std;
+
+// Center of a circle of known radius through pts, by Gauss-Newton on sum (|p - c| - r)^2 starting from center.
+// Rejected (center unchanged) if the points cover only one side of the circle, so the center is not constrained,
+// or if the center would move by more than max_shift.
+inline bool refineCircleCenter(const vector<Eigen::Vector2f>& pts, double radius, double max_shift, Eigen::Vector2f& center)
+{
+    if(pts.size() < 3)
+        return false;
+    Eigen::Vector2f mean = Eigen::Vector2f::Zero();
+    for(const auto& p : pts)
+        mean += (p - center).normalized();
+    if(mean.norm() / pts.size() > 0.5)
+        return false;
+
+    Eigen::Vector2f c = center;
+    for(int iter = 0; iter < 10; iter++)
+    {
+        Eigen::Matrix2f JtJ = Eigen::Matrix2f::Zero();
+        Eigen::Vector2f Jtr = Eigen::Vector2f::Zero();
+        for(const auto& p : pts)
+        {
+            Eigen::Vector2f d = c - p;
+            float len = d.norm();
+            if(len < 1e-6f) continue;
+            Eigen::Vector2f J = d / len;
+            JtJ += J * J.transpose();
+            Jtr += J * (len - radius);
+        }
+        Eigen::Vector2f step = JtJ.ldlt().solve(-Jtr);
+        if(!step.allFinite())   return false;
+        c += step;
+        if(step.norm() < 1e-5f) break;
+    }
+    if((c - center).norm() > max_shift)
+        return false;
+    center = c;
+    return true;
+}
+
+// Circles of known radius in 2D edge points, in place of repeated SACMODEL_CIRCLE2D RANSAC.
+// Every point votes for the accumulator cells whose centers lie within threshold_ of the circle of radius_
+// around it, so the count of a cell is the number of inliers of a circle centered there. The peaks are taken
+// in order of their count and accepted with the checks of the four-circle pattern: at least min_votes_
+// inliers, distance to the pattern centroid within [centroid_dis_min_, centroid_dis_max_] and at least
+// min_separation_ from the circles already accepted (non-maximum suppression). Every accepted center is then
+// fitted to its inliers, so it is not limited to the cell size.
+// Deterministic and linear in the number of points (a fixed number of cells per point).
+class HoughCircleDetector
+{
+    private:
+        double radius_ = 0.12, threshold_ = 0.02, cell_size_ = 0.01;
+        double centroid_dis_min_ = 0.15, centroid_dis_max_ = 0.25, min_separation_ = 0.25;
+        int min_votes_ = 4, max_peaks_ = 16;
+        vector<int> acc_;
+
+        void selectInliers(const vector<Eigen::Vector2f>& pts, const Eigen::Vector2f& c, vector<Eigen::Vector2f>& circle_pts) const
+        {
+            circle_pts.clear();
+            for(const auto& p : pts)
+            {
+                if(fabs((p - c).norm() - radius_) < threshold_)
+                    circle_pts.push_back(p);
+            }
+        }
+
+    public:
+        HoughCircleDetector(){};
+        ~HoughCircleDetector(){};
+
+        void setRadius(double radius) { radius_ = radius; }
+        // inlier distance to the circle, also the half width of the voting annulus
+        void setDistanceThreshold(double threshold) { threshold_ = threshold; }
+        void setCellSize(double cell_size) { cell_size_ = cell_size; }
+        void setCentroidDis(double min, double max)
+        {
+            centroid_dis_min_ = min;
+            centroid_dis_max_ = max;
+        }
+        void setMinSeparation(double dis) { min_separation_ = dis; }
+        void setMinVotes(int n) { min_votes_ = n; }
+
+        // up to max_circles centers, in order of their inlier count; inliers (optional) gets the points of each
+        int detect(const vector<Eigen::Vector2f>& pts, const Eigen::Vector2f& centroid, int max_circles,
+                   vector<Eigen::Vector2f>& centers, vector<vector<Eigen::Vector2f> >* inliers = nullptr)
+        {
+            centers.clear();
+            if(inliers) inliers->clear();
+            if(pts.size() < 3 || cell_size_ <= 0)
+                return 0;
+
+            // ------ accumulator over the bounding box of the possible centers, within reach of the centroid ------
+            const float h = cell_size_, r_out = radius_ + threshold_, r_in = max(0.0, radius_ - threshold_);
+            Eigen::Vector2f lo = pts[0], hi = pts[0];
+            for(const auto& p : pts)
+            {
+                lo = lo.cwiseMin(p);
+                hi = hi.cwiseMax(p);
+            }
+            lo.array() -= r_out;
+            hi.array() += r_out;
+            // no center is accepted beyond centroid_dis_max_, so a stray point far away does not blow up the grid
+            const float reach = centroid_dis_max_ + r_out;
+            lo = lo.cwiseMax(centroid - Eigen::Vector2f::Constant(reach));
+            hi = hi.cwiseMin(centroid + Eigen::Vector2f::Constant(reach));
+            if(!(lo[0] < hi[0] && lo[1] < hi[1]))
+                return 0;
+            const int W = (int)((hi[0] - lo[0]) / h) + 1, H = (int)((hi[1] - lo[1]) / h) + 1;
+            acc_.assign(W * H, 0);
+
+            // ------ vote: the cell centers inside the annulus around every point, row by row ------
+            const float r_out2 = r_out * r_out, r_in2 = r_in * r_in;
+            for(const auto& p : pts)
+            {
+                int y0 = max(0, (int)ceil((p[1] - r_out - lo[1]) / h - 0.5f));
+                int y1 = min(H - 1, (int)floor((p[1] + r_out - lo[1]) / h - 0.5f));
+                for(int y = y0; y <= y1; y++)
+                {
+                    float dy = lo[1] + (y + 0.5f) * h - p[1];
+                    float dy2 = dy * dy;
+                    if(dy2 > r_out2)    continue;
+                    float x_out = sqrt(r_out2 - dy2), x_in = dy2 < r_in2 ? sqrt(r_in2 - dy2) : 0.0f;
+                    // |dx| in [x_in, x_out], on both sides of p
+                    int xa0 = max(0, (int)ceil((p[0] - x_out - lo[0]) / h - 0.5f));
+                    int xa1 = min(W - 1, (int)floor((p[0] - x_in - lo[0]) / h - 0.5f));
+                    int xb0 = max(0, (int)ceil((p[0] + x_in - lo[0]) / h - 0.5f));
+                    int xb1 = min(W - 1, (int)floor((p[0] + x_out - lo[0]) / h - 0.5f));
+                    if(xb0 <= xa1)  xb0 = xa1 + 1;      // the two spans meet: count every cell once
+                    int* row = &acc_[y * W];
+                    for(int x = xa0; x <= xa1; x++)     row[x]++;
+                    for(int x = xb0; x <= xb1; x++)     row[x]++;
+                }
+            }
+
+            // ------ peaks, strongest first, with the pattern checks ------
+            const int sup_sep = (int)ceil(min_separation_ / h), sup_rej = max(1, (int)ceil(threshold_ / h));
+            auto suppress = [&](int cx, int cy, int rad)
+            {
+                for(int y = max(0, cy - rad); y <= min(H - 1, cy + rad); y++)
+                    for(int x = max(0, cx - rad); x <= min(W - 1, cx + rad); x++)
+                    {
+                        if((x - cx) * (x - cx) + (y - cy) * (y - cy) <= rad * rad)
+                            acc_[y * W + x] = 0;
+                    }
+            };
+            vector<Eigen::Vector2f> circle_pts;
+            for(int peak = 0; peak < max_peaks_ && (int)centers.size() < max_circles; peak++)
+            {
+                int best = max_element(acc_.begin(), acc_.end()) - acc_.begin();
+                if(acc_[best] < min_votes_)
+                    break;
+                int bx = best % W, by = best / W;
+                Eigen::Vector2f c(lo[0] + (bx + 0.5f) * h, lo[1] + (by + 0.5f) * h);
+
+                // refit and reselect: the cell center can still catch points of a neighbouring circle
+                for(int iter = 0; iter < 3; iter++)
+                {
+                    selectInliers(pts, c, circle_pts);
+                    if(!refineCircleCenter(circle_pts, radius_, threshold_, c))
+                        break;
+                }
+
+                double centroid_distance = (c - centroid).norm();
+                bool valid = centroid_distance >= centroid_dis_min_ && centroid_distance <= centroid_dis_max_;
+                for(const auto& f : centers)
+                {
+                    if((f - c).norm() < min_separation_)
+                        valid = false;
+                }
+                if(!valid)
+                {
+                    suppress(bx, by, sup_rej);
+                    continue;
+                }
+                centers.push_back(c);
+                if(inliers)
+                {
+                    selectInliers(pts, c, circle_pts);
+                    inliers->push_back(circle_pts);
+                }
+                suppress(bx, by, sup_sep);
+            }
+            return centers.size();
+        }
+};
+
+// Up to four pattern circles of the given radius among the points of cloud (x, y: the pattern plane), appended to
+// found_centers as the {x, y, z} triplets the circle search collects. Shared by FourCircleCenters and the pattern
+// nodes. The accumulator cell is half the inlier threshold, kept within [5 mm, 1 cm].
+template<typename CloudT>
+int findPatternCirclesHough(HoughCircleDetector& hough, const CloudT& cloud, const Eigen::Vector2f& centroid, double radius,
+                            double threshold, double centroid_dis_min, double centroid_dis_max, float z,
+                            vector<vector<float> >& found_centers)
+{
+    hough.setRadius(radius);
+    hough.setDistanceThreshold(threshold);
+    hough.setCellSize(min(0.01, max(0.005, threshold / 2)));
+    hough.setCentroidDis(centroid_dis_min, centroid_dis_max);
+    hough.setMinSeparation(0.25);
+
+    vector<Eigen::Vector2f> pts, centers;
+    pts.reserve(cloud.points.size());
+    for(const auto& p : cloud.points)
+        pts.push_back(Eigen::Vector2f(p.x, p.y));
+    hough.detect(pts, centroid, 4, centers);
+    for(const auto& c : centers)
+        found_centers.push_back(vector<float>{c[0], c[1], z});
+    return centers.size();
+}
+
+// Rigid fit of the whole circle pattern to the edge points, instead of fitting every circle on its own.
+// The pattern is given by its circle centers in the pattern frame (setPattern(), e.g. the four corners of a
+// square) and the known radius; the pose (tx, ty, theta) maps it into the frame of the points.
+// Every point is assigned to its closest circle and the pose is solved by Gauss-Newton with Huber weights
+// (scale threshold_); points farther than 3 * threshold_ from every circle are ignored. A circle whose own
+// points are off still gets its center from the others, so one bad circle no longer costs the frame.
+// After fit(), covariance() is the pose covariance sigma^2 (J^T W J)^-1 and centerCovariance() its propagation
+// to one center.
+class CirclePatternFit
+{
+    private:
+        double radius_ = 0.12, threshold_ = 0.02;
+        int min_support_ = 3;       // inliers for a circle to count as seen
+        vector<Eigen::Vector2f> model_;
+        Eigen::Vector3d pose_ = Eigen::Vector3d::Zero();
+        Eigen::Matrix3d cov_ = Eigen::Matrix3d::Zero();
+        vector<int> support_;
+
+        Eigen::Vector2d center(const Eigen::Vector3d& pose, int k) const
+        {
+            double c = cos(pose[2]), s = sin(pose[2]);
+            const Eigen::Vector2f& m = model_[k];
+            return Eigen::Vector2d(c * m[0] - s * m[1] + pose[0], s * m[0] + c * m[1] + pose[1]);
+        }
+        // d center / d theta
+        Eigen::Vector2d centerDTheta(const Eigen::Vector3d& pose, int k) const
+        {
+            double c = cos(pose[2]), s = sin(pose[2]);
+            const Eigen::Vector2f& m = model_[k];
+            return Eigen::Vector2d(-s * m[0] - c * m[1], c * m[0] - s * m[1]);
+        }
+
+    public:
+        CirclePatternFit(){};
+        ~CirclePatternFit(){};
+
+        void setRadius(double radius) { radius_ = radius; }
+        void setDistanceThreshold(double threshold) { threshold_ = threshold; }
+        void setMinSupport(int n) { min_support_ = n; }
+        void setPattern(const vector<Eigen::Vector2f>& model) { model_ = model; }
+        // four circles at the corners of a spacing_x x spacing_y rectangle centered on the pattern origin
+        void setPattern(double spacing_x, double spacing_y)
+        {
+            model_.clear();
+            for(int sy = -1; sy <= 1; sy += 2)
+                for(int sx = -1; sx <= 1; sx += 2)
+                    model_.push_back(Eigen::Vector2f(sx * spacing_x / 2, sy * spacing_y / 2));
+        }
+
+        // initial pose from at least two detected centers (any subset of the circles, in any order): every
+        // assignment of the first two to model circles that fits all detected centers is scored by its inliers
+        // among pts, as two neighbouring circles alone do not tell on which side the others are
+        bool initialize(const vector<Eigen::Vector2f>& centers, const vector<Eigen::Vector2f>& pts, Eigen::Vector3d& pose) const
+        {
+            if(centers.size() < 2 || model_.size() < 2)
+                return false;
+            const Eigen::Vector2d a = centers[0].cast<double>(), b = centers[1].cast<double>();
+            int best_inliers = -1;
+            for(size_t j = 0; j < model_.size(); j++)
+            {
+                for(size_t l = 0; l < model_.size(); l++)
+                {
+                    if(l == j)  continue;
+                    Eigen::Vector2d mj = model_[j].cast<double>(), ml = model_[l].cast<double>();
+                    double theta = atan2((b - a)[1], (b - a)[0]) - atan2((ml - mj)[1], (ml - mj)[0]);
+                    Eigen::Rotation2Dd R(theta);
+                    Eigen::Vector2d t = (a + b) / 2 - R * (mj + ml) / 2;
+                    Eigen::Vector3d p(t[0], t[1], theta);
+                    bool consistent = true;
+                    for(const auto& f : centers)
+                    {
+                        double d_min = INFINITY;
+                        for(size_t k = 0; k < model_.size(); k++)
+                            d_min = min(d_min, (center(p, k) - f.cast<double>()).norm());
+                        consistent &= d_min < radius_ / 2;
+                    }
+                    if(!consistent) continue;
+                    int inliers = 0;
+                    for(const auto& q : pts)
+                    {
+                        for(size_t k = 0; k < model_.size(); k++)
+                        {
+                            if(fabs((center(p, k) - q.cast<double>()).norm() - radius_) < threshold_)
+                            {
+                                inliers++;
+                                break;
+                            }
+                        }
+                    }
+                    if(inliers > best_inliers)
+                    {
+                        best_inliers = inliers;
+                        pose = p;
+                    }
+                }
+            }
+            return best_inliers >= 0;
+        }
+
+        // pose: the initial pose in, the fitted pose out
+        bool fit(const vector<Eigen::Vector2f>& pts, Eigen::Vector3d& pose)
+        {
+            const int K = model_.size();
+            support_.assign(K, 0);
+            if(K == 0 || pts.size() < 3)
+                return false;
+            const double gate = 3 * threshold_;
+            Eigen::Matrix3d JtWJ = Eigen::Matrix3d::Zero();
+            double wee = 0;
+            int n_used = 0;
+            for(int iter = 0; iter <= 20; iter++)
+            {
+                JtWJ.setZero();
+                Eigen::Vector3d JtWe = Eigen::Vector3d::Zero();
+                wee = 0;
+                n_used = 0;
+                support_.assign(K, 0);
+                for(const auto& pf : pts)
+                {
+                    Eigen::Vector2d p = pf.cast<double>(), d = Eigen::Vector2d::Zero();
+                    double e = INFINITY;
+                    int k_best = -1;
+                    for(int k = 0; k < K; k++)
+                    {
+                        Eigen::Vector2d dk = center(pose, k) - p;
+                        double ek = dk.norm() - radius_;
+                        if(fabs(ek) < fabs(e))
+                        {
+                            e = ek;
+                            d = dk;
+                            k_best = k;
+                        }
+                    }
+                    if(fabs(e) > gate || d.norm() < 1e-9)
+                        continue;
+                    if(fabs(e) < threshold_)    support_[k_best]++;
+                    double w = fabs(e) <= threshold_ ? 1.0 : threshold_ / fabs(e);   // Huber
+                    Eigen::Vector2d u = d / d.norm();
+                    Eigen::Vector3d J(u[0], u[1], u.dot(centerDTheta(pose, k_best)));
+                    JtWJ += w * J * J.transpose();
+                    JtWe += w * J * e;
+                    wee += w * e * e;
+                    n_used++;
+                }
+                if(n_used < 3 || iter == 20)
+                    break;
+                Eigen::Vector3d step = JtWJ.ldlt().solve(-JtWe);
+                if(!step.allFinite())
+                    return false;
+                pose += step;
+                if(step.head<2>().norm() < 1e-6 && fabs(step[2]) < 1e-6)
+                    iter = 19;      // converged: one more pass for the final weights and support
+            }
+            if(n_used <= 3)
+                return false;
+            Eigen::FullPivLU<Eigen::Matrix3d> lu(JtWJ);
+            if(!lu.isInvertible())
+                return false;
+            cov_ = wee / (n_used - 3) * lu.inverse();
+            pose_ = pose;
+            return true;
+        }
+
+        int supportedCircles() const
+        {
+            int n = 0;
+            for(int s : support_)   n += s >= min_support_;
+            return n;
+        }
+        // inliers of circle k in the last fit()
+        int support(int k) const { return support_[k]; }
+        // circle centers of the last fitted pose, in model order
+        void centers(vector<Eigen::Vector2f>& out) const
+        {
+            out.clear();
+            for(size_t k = 0; k < model_.size(); k++)
+                out.push_back(center(pose_, k).cast<float>());
+        }
+        const Eigen::Matrix3d& covariance() const { return cov_; }
+        Eigen::Matrix2d centerCovariance(int k) const
+        {
+            Eigen::Matrix<double, 2, 3> J;
+            J << 1, 0, 0,
+                 0, 1, 0;
+            J.col(2) = centerDTheta(pose_, k);
+            return J * cov_ * J.transpose();
+        }
+};
+
+// Seeds a CirclePatternFit (square pattern of the given spacing) with the circles in found_centers and fits it to
+// the points of cloud (x, y: the pattern plane). Only if the fit converges with at least three circles supported,
+// found_centers is replaced by the four fitted centers at height z, in the order of the pattern, and true returned.
+// Shared by FourCircleCenters and the pattern nodes; fit keeps the supports and covariances for the caller.
+template<typename CloudT>
+bool fitCirclePattern(CirclePatternFit& fit, const CloudT& cloud, double radius, double threshold, double spacing,
+                      float z, vector<vector<float> >& found_centers)
+{
+    fit.setRadius(radius);
+    fit.setDistanceThreshold(threshold);
+    fit.setPattern(spacing, spacing);
+
+    vector<Eigen::Vector2f> seeds, pts, centers;
+    seeds.reserve(found_centers.size());
+    for(const auto& c : found_centers)
+        seeds.push_back(Eigen::Vector2f(c[0], c[1]));
+    pts.reserve(cloud.points.size());
+    for(const auto& p : cloud.points)
+        pts.push_back(Eigen::Vector2f(p.x, p.y));
+    Eigen::Vector3d pose;
+    if(!fit.initialize(seeds, pts, pose) || !fit.fit(pts, pose) || fit.supportedCircles() < 3)
+        return false;
+    fit.centers(centers);
+    found_centers.clear();
+    for(const auto& c : centers)
+        found_centers.push_back(vector<float>{c[0], c[1], z});
+    return true;
+}
+
+// Points set aside by the RANSAC circle search (the inliers of a circle too close to the pattern centroid),
+// binned on a 2D grid over x, y so that the points around a later valid center are dropped by visiting the
+// cells within the radius instead of scanning them all. The distance test itself is the full 3D one.
+// With the cell edge at least the removal radius, that is the 3x3 cells around the center.
+class CirclePointHash
+{
+    private:
+        double cell_ = 0.14, inv_cell_ = 1.0 / 0.14;
+        vector<Eigen::Vector3f> pts_;
+        unordered_map<uint64_t, vector<int> > cells_;   // indices into pts_ of the points still held
+        size_t size_ = 0;
+
+        int64_t cellOf(float v) const { return (int64_t)floor(v * inv_cell_); }
+        static uint64_t cellKey(int64_t ix, int64_t iy)
+        {
+            return ((uint64_t)(uint32_t)ix << 32) | (uint32_t)iy;
+        }
+
+    public:
+        CirclePointHash(){};
+        ~CirclePointHash(){};
+
+        // changing the cell edge drops the points held
+        void setCellSize(double cell)
+        {
+            cell_ = cell;
+            inv_cell_ = 1.0 / cell;
+            clear();
+        }
+        void clear()
+        {
+            pts_.clear();
+            cells_.clear();
+            size_ = 0;
+        }
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+        template<typename PointT>
+        void insert(const PointT& p)
+        {
+            if(!isfinite(p.x) || !isfinite(p.y) || !isfinite(p.z))
+                return;
+            cells_[cellKey(cellOf(p.x), cellOf(p.y))].push_back(pts_.size());
+            pts_.push_back(Eigen::Vector3f(p.x, p.y, p.z));
+            size_++;
+        }
+
+        // drops the points closer than radius to (x, y, z), returns how many
+        int removeRadius(float x, float y, float z, double radius)
+        {
+            const Eigen::Vector3f c(x, y, z);
+            const float r2 = radius * radius;
+            const int64_t reach = (int64_t)ceil(radius * inv_cell_);
+            const int64_t cx = cellOf(x), cy = cellOf(y);
+            int removed = 0;
+            for(int64_t iy = cy - reach; iy <= cy + reach; iy++)
+            {
+                for(int64_t ix = cx - reach; ix <= cx + reach; ix++)
+                {
+                    auto it = cells_.find(cellKey(ix, iy));
+                    if(it == cells_.end())
+                        continue;
+                    vector<int>& cell = it->second;
+                    for(size_t j = 0; j < cell.size(); )
+                    {
+                        if((pts_[cell[j]] - c).squaredNorm() < r2)
+                        {
+                            cell[j] = cell.back();
+                            cell.pop_back();
+                            removed++;
+                        }
+                        else
+                            j++;
+                    }
+                    if(cell.empty())
+                        cells_.erase(it);
+                }
+            }
+            size_ -= removed;
+            return removed;
+        }
+};
+
+#endif
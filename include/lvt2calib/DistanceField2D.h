@@ -0,0 +1,226 @@
+#ifndef DistanceField2D_H
+#define DistanceField2D_H
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <Eigen/Dense>
+#include <pcl/point_cloud.h>
+#include <pcl/kdtree/kdtree_flann.h>
+
+using namespace std;
+
+// Nearest-neighbour lookup table for a static, planar point set (the calibration template).
+// The template plane is rasterized and a 2D Euclidean distance transform (Felzenszwalb & Huttenlocher)
+// stores for every cell the template point whose cell is closest. A query looks at the stored points
+// of its own and the 8 neighbouring cells and returns the exact 3D distance to the best of them.
+// That is the true nearest distance for most queries and never more than about one cell too large.
+// Queries outside the grid fall back to a KD-tree over the template.
+template<typename PointT>
+class DistanceField2D
+{
+    private:
+        vector<Eigen::Vector3f> sites_;     // template points
+        vector<Eigen::Vector3f> sites_l_;   // template points in plane coordinates (u, v, w)
+        Eigen::Matrix3f R_;                 // rows: in-plane axes u, v and the plane normal
+        Eigen::Vector3f origin_;            // template centroid
+        double res_ = 0.005, inv_res_ = 200.0;
+        float u0_ = 0.0, v0_ = 0.0;         // lower corner of the grid in plane coordinates
+        int nu_ = 0, nv_ = 0;
+        vector<int> nearest_;               // per cell (iu * nv_ + iv): index of the nearest site
+        pcl::KdTreeFLANN<PointT> fallback_;
+        bool valid_ = false;
+
+        // 1D squared distance transform of f (lower envelope of parabolas), with the arg-min
+        static void edt1d(const double* f, int n, double* d, int* arg, int* v, double* z)
+        {
+            const double INF = numeric_limits<double>::infinity();
+            int k = 0;
+            v[0] = 0;
+            z[0] = -INF;
+            z[1] = INF;
+            for(int q = 1; q < n; q++)
+            {
+                double s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * q - 2.0 * v[k]);
+                while(s <= z[k])
+                {
+                    k--;
+                    s = ((f[q] + (double)q * q) - (f[v[k]] + (double)v[k] * v[k])) / (2.0 * q - 2.0 * v[k]);
+                }
+                k++;
+                v[k] = q;
+                z[k] = s;
+                z[k + 1] = INF;
+            }
+            k = 0;
+            for(int q = 0; q < n; q++)
+            {
+                while(z[k + 1] < q)
+                    k++;
+                d[q] = (double)(q - v[k]) * (q - v[k]) + f[v[k]];
+                arg[q] = v[k];
+            }
+        }
+
+        inline void toGrid(const Eigen::Vector3f& l, int& iu, int& iv) const
+        {
+            iu = (int)floor((l[0] - u0_) * inv_res_);
+            iv = (int)floor((l[1] - v0_) * inv_res_);
+        }
+
+    public:
+        DistanceField2D(){};
+        ~DistanceField2D(){};
+
+        bool valid() const { return valid_; }
+        double resolution() const { return res_; }
+
+        // plane frame: l = R * (p - origin), l = (u, v, w) with w along the template normal
+        const Eigen::Matrix3f& planeRotation() const { return R_; }
+        const Eigen::Vector3f& planeOrigin() const { return origin_; }
+        const Eigen::Vector3f& sitePlane(int i) const { return sites_l_[i]; }
+        inline Eigen::Vector3f toPlane(const Eigen::Vector3f& p) const { return R_ * (p - origin_); }
+
+        void build(const typename pcl::PointCloud<PointT>::Ptr& cloud, double resolution = 0.005, double margin = 0.25)
+        {
+            valid_ = false;
+            sites_.clear();
+            sites_l_.clear();
+            nearest_.clear();
+            if(cloud->points.empty())
+                return;
+            for(auto& p : cloud->points)
+                sites_.push_back(Eigen::Vector3f(p.x, p.y, p.z));
+            fallback_.setInputCloud(cloud);
+
+            // ------ plane frame of the template ------
+            Eigen::Vector3f mean = Eigen::Vector3f::Zero();
+            for(auto& s : sites_)   mean += s;
+            mean /= (float)sites_.size();
+            Eigen::Matrix3f cov = Eigen::Matrix3f::Zero();
+            for(auto& s : sites_)   cov += (s - mean) * (s - mean).transpose();
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> es(cov);     // eigenvalues in increasing order
+            R_.row(0) = es.eigenvectors().col(2).transpose();
+            R_.row(1) = es.eigenvectors().col(1).transpose();
+            R_.row(2) = es.eigenvectors().col(0).transpose();
+            origin_ = mean;
+            for(auto& s : sites_)
+                sites_l_.push_back(toPlane(s));
+
+            // ------ grid over the template bounding box plus margin ------
+            res_ = resolution;
+            inv_res_ = 1.0 / resolution;
+            float u_min = numeric_limits<float>::max(), v_min = u_min, u_max = -u_min, v_max = -u_min;
+            for(auto& l : sites_l_)
+            {
+                u_min = min(u_min, l[0]);  u_max = max(u_max, l[0]);
+                v_min = min(v_min, l[1]);  v_max = max(v_max, l[1]);
+            }
+            u0_ = u_min - margin;
+            v0_ = v_min - margin;
+            nu_ = (int)ceil((u_max + margin - u0_) * inv_res_) + 1;
+            nv_ = (int)ceil((v_max + margin - v0_) * inv_res_) + 1;
+
+            // ------ seed cells: keep the site closest to the cell centre ------
+            const double BIG = 1e20;
+            vector<int> seed(nu_ * nv_, -1);
+            vector<float> seed_d(nu_ * nv_, numeric_limits<float>::max());
+            for(int i = 0; i < (int)sites_.size(); i++)
+            {
+                const Eigen::Vector3f& l = sites_l_[i];
+                int iu, iv;
+                toGrid(l, iu, iv);
+                float du = l[0] - (u0_ + (iu + 0.5) * res_), dv = l[1] - (v0_ + (iv + 0.5) * res_);
+                float d = du * du + dv * dv;
+                if(d < seed_d[iu * nv_ + iv])
+                {
+                    seed_d[iu * nv_ + iv] = d;
+                    seed[iu * nv_ + iv] = i;
+                }
+            }
+
+            // ------ separable EDT: along v for every u, then along u for every v ------
+            int n_max = max(nu_, nv_);
+            vector<double> f(n_max), d(n_max), z(n_max + 1);
+            vector<int> arg(n_max), v(n_max);
+            vector<double> d_col(nu_ * nv_);
+            vector<int> arg_v(nu_ * nv_);
+            for(int iu = 0; iu < nu_; iu++)
+            {
+                for(int iv = 0; iv < nv_; iv++)
+                    f[iv] = (seed[iu * nv_ + iv] >= 0) ? 0.0 : BIG;
+                edt1d(f.data(), nv_, d.data(), arg.data(), v.data(), z.data());
+                for(int iv = 0; iv < nv_; iv++)
+                {
+                    d_col[iu * nv_ + iv] = d[iv];
+                    arg_v[iu * nv_ + iv] = arg[iv];
+                }
+            }
+            nearest_.assign(nu_ * nv_, -1);
+            for(int iv = 0; iv < nv_; iv++)
+            {
+                for(int iu = 0; iu < nu_; iu++)
+                    f[iu] = d_col[iu * nv_ + iv];
+                edt1d(f.data(), nu_, d.data(), arg.data(), v.data(), z.data());
+                for(int iu = 0; iu < nu_; iu++)
+                {
+                    int su = arg[iu];
+                    nearest_[iu * nv_ + iv] = seed[su * nv_ + arg_v[su * nv_ + iv]];
+                }
+            }
+            valid_ = true;
+        }
+
+        // Index of the nearest template point to l (plane coordinates), sqr_dist gets its squared distance.
+        inline int nearestInPlane(const Eigen::Vector3f& l, float& sqr_dist) const
+        {
+            int iu, iv;
+            toGrid(l, iu, iv);
+            if(iu >= 1 && iv >= 1 && iu < nu_ - 1 && iv < nv_ - 1)
+            {
+                int best_i = -1;
+                sqr_dist = numeric_limits<float>::max();
+                for(int a = -1; a <= 1; a++)
+                {
+                    const int* row = &nearest_[(iu + a) * nv_ + iv];
+                    for(int b = -1; b <= 1; b++)
+                    {
+                        if(row[b] < 0)  continue;
+                        float d = (l - sites_l_[row[b]]).squaredNorm();
+                        if(d < sqr_dist)
+                        {
+                            sqr_dist = d;
+                            best_i = row[b];
+                        }
+                    }
+                }
+                return best_i;
+            }
+            static thread_local vector<int> k_idx(1);
+            static thread_local vector<float> k_sqr_dis(1);
+            Eigen::Vector3f p = R_.transpose() * l + origin_;
+            PointT pt;
+            pt.x = p[0];  pt.y = p[1];  pt.z = p[2];
+            if(fallback_.nearestKSearch(pt, 1, k_idx, k_sqr_dis) > 0)
+            {
+                sqr_dist = k_sqr_dis[0];
+                return k_idx[0];
+            }
+            sqr_dist = numeric_limits<float>::max();
+            return -1;
+        }
+
+        // Squared distance from p to the nearest template point.
+        inline float nearestSqrDistance(const PointT& pt) const
+        {
+            float d;
+            nearestInPlane(toPlane(Eigen::Vector3f(pt.x, pt.y, pt.z)), d);
+            return d;
+        }
+        inline float nearestDistance(const PointT& pt) const
+        {
+            return sqrt(nearestSqrDistance(pt));
+        }
+};
+
+#endif
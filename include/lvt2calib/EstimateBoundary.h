@@ -12,6 +12,8 @@
 #include <pcl/features/normal_3d.h>
 #include <pcl/features/boundary.h>
 #include <boost/thread/thread.hpp>
+#include "SpatialIndex.h"
+#include "GridBoundary.h"
 
 
 #define DEBUG 0
@@ -23,6 +25,7 @@ class EstimateBoundary
 {
     protected:
         double re_ = 30, reforn_ = 50;
+        double grid_cell_ = 0.0, grid_min_fill_ = 0.5;     // see GridBoundaryEstimation
 
     public:
         EstimateBoundary(double re, double reforn): re_(re), reforn_(reforn) {}
@@ -30,20 +33,43 @@ class EstimateBoundary
         ~EstimateBoundary(){};
         void setNormEstKSearch(double reforn) { reforn_ = reforn; }
         void setBoundEstKSearch(double re) { re_ = re; }
+        void setGridBoundaryParam(double cell_size, double min_fill)
+        {
+            grid_cell_ = cell_size;
+            grid_min_fill_ = min_fill;
+        }
         void estimateBorders(pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, pcl::PointCloud<pcl::Boundary>::Ptr &boundaries);
+        // tree: search tree over cloud_in, shared by the normal and the boundary estimation (see SpatialIndex)
+        void estimateBorders(pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, pcl::PointCloud<pcl::Boundary>::Ptr &boundaries,
+                             const pcl::search::KdTree<pcl::PointXYZI>::Ptr &tree);
+        // Boundary of the subset indices of cloud_in, with the normals of cloud_in already known (indexed like its points),
+        // so nothing is copied and no normal is estimated. tree: search tree over cloud_in restricted to indices.
+        // boundaries[k] belongs to point indices[k].
+        void estimateBorders(pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, const pcl::IndicesPtr &indices,
+                             const pcl::PointCloud<pcl::Normal>::Ptr &normals, pcl::PointCloud<pcl::Boundary>::Ptr &boundaries,
+                             const pcl::search::KdTree<pcl::PointXYZI>::Ptr &tree);
+        // Boundary of a planar cloud_in on an occupancy grid in its plane, spanned by axis_u and axis_v through origin.
+        // No normals, no search tree; safe to call from several threads.
+        void estimateBordersGrid(const pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, const Eigen::Vector3f &origin,
+                                 const Eigen::Vector3f &axis_u, const Eigen::Vector3f &axis_v, pcl::PointCloud<pcl::Boundary>::Ptr &boundaries) const;
 };
 
 template<typename PointT>
 void EstimateBoundary<PointT>::estimateBorders(pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, pcl::PointCloud<pcl::Boundary>::Ptr &boundaries)
 {
-    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>);
-    pcl::copyPointCloud(*cloud_in, *cloud);
-    
-    pcl::BoundaryEstimation<pcl::PointXYZ, pcl::Normal,pcl::Boundary> boundEst;    // boundary estimation
-    pcl::NormalEstimation<pcl::PointXYZ, pcl::Normal> normEst;   // noraml estimation
+    pcl::search::KdTree<pcl::PointXYZI>::Ptr tree(new CachedKdTree<pcl::PointXYZI>);
+    estimateBorders(cloud_in, boundaries, tree);
+}
+
+template<typename PointT>
+void EstimateBoundary<PointT>::estimateBorders(pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, pcl::PointCloud<pcl::Boundary>::Ptr &boundaries,
+                                               const pcl::search::KdTree<pcl::PointXYZI>::Ptr &tree)
+{
+    pcl::BoundaryEstimation<pcl::PointXYZI, pcl::Normal,pcl::Boundary> boundEst;    // boundary estimation
+    pcl::NormalEstimation<pcl::PointXYZI, pcl::Normal> normEst;   // noraml estimation
     pcl::PointCloud<pcl::Normal>::Ptr normals(new pcl::PointCloud<pcl::Normal>);
-    normEst.setSearchMethod(pcl::search::KdTree<pcl::PointXYZ>::Ptr(new pcl::search::KdTree<pcl::PointXYZ>));
-    normEst.setInputCloud(cloud);
+    normEst.setSearchMethod(tree);
+    normEst.setInputCloud(cloud_in);
     normEst.setKSearch(reforn_); // number of points to search
     normEst.compute(*normals);
     if(DEBUG)
@@ -52,18 +78,18 @@ void EstimateBoundary<PointT>::estimateBorders(pcl::PointCloud<pcl::PointXYZI>::
         std::cerr << "normals: " << normals->size() << std::endl;
     }
     
-    boundEst.setInputCloud(cloud);
+    boundEst.setInputCloud(cloud_in);
     boundEst.setInputNormals(normals); //the bounds estimate depends on the normal
     // boundEst.setRadiusSearch(re_); //设置边界估计所需要的半径,//这里的Threadshold为一个浮点值，可取点云模型密度的10倍
     boundEst.setKSearch(re_);
     boundEst.setAngleThreshold(M_PI / 2); //边界估计时的角度阈值M_PI / 4,并计算k邻域点的法线夹角,若大于阈值则为边界特征点
-    boundEst.setSearchMethod(pcl::search::KdTree<pcl::PointXYZ>::Ptr(new pcl::search::KdTree<pcl::PointXYZ>));
+    boundEst.setSearchMethod(tree);     // same point set as the normals: the tree is not rebuilt
     boundEst.compute(*boundaries);
 
     if(DEBUG)
     {
         std::cerr << "AngleThreshold: " << M_PI / 4 << std::endl;
-        cerr << "input cloud size = " << cloud->points.size() << endl;
+        cerr << "input cloud size = " << cloud_in->points.size() << endl;
         cerr << "boundaries.size = " << boundaries->size() << endl;
         std::cerr << "boundaries: " << boundaries->points.size() << std::endl;
     }
@@ -83,5 +109,44 @@ void EstimateBoundary<PointT>::estimateBorders(pcl::PointCloud<pcl::PointXYZI>::
     return;
 }
 
+template<typename PointT>
+void EstimateBoundary<PointT>::estimateBorders(pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, const pcl::IndicesPtr &indices,
+                                               const pcl::PointCloud<pcl::Normal>::Ptr &normals, pcl::PointCloud<pcl::Boundary>::Ptr &boundaries,
+                                               const pcl::search::KdTree<pcl::PointXYZI>::Ptr &tree)
+{
+    pcl::BoundaryEstimation<pcl::PointXYZI, pcl::Normal,pcl::Boundary> boundEst;    // boundary estimation
+    boundEst.setInputCloud(cloud_in);
+    boundEst.setIndices(indices);
+    boundEst.setInputNormals(normals);
+    boundEst.setKSearch(re_);
+    boundEst.setAngleThreshold(M_PI / 2);
+    boundEst.setSearchMethod(tree);     // already holds (cloud_in, indices): the neighbours stay within the subset
+    boundEst.compute(*boundaries);
+
+    if(DEBUG)
+    {
+        cerr << "input subset size = " << indices->size() << endl;
+        cerr << "boundaries.size = " << boundaries->size() << endl;
+    }
+}
+
+
+template<typename PointT>
+void EstimateBoundary<PointT>::estimateBordersGrid(const pcl::PointCloud<pcl::PointXYZI>::Ptr &cloud_in, const Eigen::Vector3f &origin,
+                                                   const Eigen::Vector3f &axis_u, const Eigen::Vector3f &axis_v,
+                                                   pcl::PointCloud<pcl::Boundary>::Ptr &boundaries) const
+{
+    static thread_local GridBoundaryEstimation grid;    // keeps its buffers from candidate to candidate
+    grid.setCellSize(grid_cell_);
+    grid.setMinFill(grid_min_fill_);
+    grid.compute(*cloud_in, origin, axis_u, axis_v, *boundaries);
+
+    if(DEBUG)
+    {
+        cerr << "input cloud size = " << cloud_in->points.size() << endl;
+        cerr << "grid cell = " << grid.cellSize() << endl;
+    }
+}
+
 
 #endif
\ No newline at end of file
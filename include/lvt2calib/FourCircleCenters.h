@@ -28,6 +28,8 @@
 #include <pcl/segmentation/extract_clusters.h>
 #include <pcl/segmentation/sac_segmentation.h>
 
+#include "CircleDetection.h"
+
 using namespace std;
 using namespace Eigen;
 
@@ -38,30 +40,76 @@ class FourCircleCenters
         double circle_seg_thre_ = 0.02, circle_radius_ = 0.12, centroid_dis_min_ = 0.15, centroid_dis_max_ = 0.25; 
         int min_centers_found_ = 4; 
 
+        // circle centers of the template, see FindTemplateCenters()
+        pcl::PointCloud<pcl::PointXYZI>::Ptr template_centers_;
+        pcl::PointCloud<pcl::PointXYZI>::ConstPtr centers_template_;    // the template they were extracted from
+        bool template_found_ = false;
+        bool refine_centers_ = false;
+        bool use_hough_ = true;
+        HoughCircleDetector hough_;
+        bool use_pattern_fit_ = true;
+        double circle_spacing_ = 0.3;   // distance between neighbouring circle centers
+        CirclePatternFit pattern_fit_;
+
+        void invalidateTemplateCenters() { centers_template_.reset(); }
+        void findCentersHough(const pcl::PointCloud<pcl::PointXYZI>& cloud, const pcl::PointXYZI& centroid, std::vector< std::vector<float> >& found_centers);
+        bool fitPattern(const pcl::PointCloud<pcl::PointXYZI>& cloud, std::vector< std::vector<float> >& found_centers);
+
     public:
         FourCircleCenters(){};
         ~FourCircleCenters(){};
 
         void setCircleSegDistanceThreshold(double threshold)
         {
+            if(threshold != circle_seg_thre_)   invalidateTemplateCenters();
             circle_seg_thre_ = threshold;
         }
         void setCircleRadius(double radius)
         {
+            if(radius != circle_radius_)    invalidateTemplateCenters();
             circle_radius_ = radius;
         }
         void setCentroidDis(double min, double max)
         {
+            if(min != centroid_dis_min_ || max != centroid_dis_max_)    invalidateTemplateCenters();
             centroid_dis_min_ = min;
             centroid_dis_max_ = max;
         }
         void setMinNumCentersFound(int num)
         {
+            if(num != min_centers_found_)   invalidateTemplateCenters();
             min_centers_found_ = num;
         }
+        // FindTemplateCenters(): fit every circle again to the board boundary points near it
+        void useCenterRefinement(bool flag) { refine_centers_ = flag; }
+        // FindFourCenters() with Tr_tpl2ukn: the circles found seed a rigid fit of the whole pattern (see CirclePatternFit),
+        // FindTemplateCenters(): the refinement moves the template pattern as a whole
+        void usePatternFit(bool flag)
+        {
+            if(flag != use_pattern_fit_)    invalidateTemplateCenters();
+            use_pattern_fit_ = flag;
+        }
+        void setCircleSpacing(double spacing)
+        {
+            if(spacing != circle_spacing_)  invalidateTemplateCenters();
+            circle_spacing_ = spacing;
+        }
+        // FindFourCenters() with Tr_tpl2ukn: circles from a fixed-radius Hough accumulator instead of repeated RANSAC
+        void useHough(bool flag)
+        {
+            if(flag != use_hough_)  invalidateTemplateCenters();
+            use_hough_ = flag;
+        }
 
         bool FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &calib_boundary_, pcl::PointCloud<pcl::PointXYZI>::Ptr &circle_center_cloud_, Eigen::Matrix4f Tr_tpl2ukn);
         bool FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &calib_boundary_, pcl::PointCloud<pcl::PointXYZI>::Ptr &circle_center_cloud_);
+        // Same result as FindFourCenters(template_boundary_, circle_center_cloud_, Tr_tpl2ukn) when the circles are searched
+        // on the template: the template centers are extracted once (again only after a parameter or template change)
+        // and then only transformed. With useCenterRefinement(), every center is then fitted to the points of
+        // board_boundary_ (in the frame of the result) within circle_seg_thre_ of its circle.
+        bool FindTemplateCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &template_boundary_, pcl::PointCloud<pcl::PointXYZI>::Ptr &circle_center_cloud_,
+                                 const Eigen::Matrix4f& Tr_tpl2ukn,
+                                 const pcl::PointCloud<pcl::PointXYZI>::Ptr &board_boundary_ = pcl::PointCloud<pcl::PointXYZI>::Ptr());
 };
 
 
@@ -112,10 +160,15 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
     // }
     pcl::ExtractIndices<pcl::PointXYZI> extract;
     std::vector< std::vector<float> > found_centers;
-    std::vector<pcl::PointXYZI> centroid_cloud_inliers;
+    CirclePointHash centroid_cloud_inliers;     // circle points set aside near the centroid
+    centroid_cloud_inliers.setCellSize(circle_radius_ + 0.02);
     bool valid = true;   // if it is a valid center
 
-    while ((copy_cloud->points.size() + centroid_cloud_inliers.size()) > 3 && found_centers.size() < 4 && copy_cloud->points.size())    
+    if(use_hough_)
+        findCentersHough(*copy_cloud, edges_centroid, found_centers);
+
+    // RANSAC: one circle at a time, its inliers are removed before the next one
+    while (!use_hough_ && (copy_cloud->points.size() + centroid_cloud_inliers.size()) > 3 && found_centers.size() < 4 && copy_cloud->points.size())    
     {
         circle_segmentation.setInputCloud (copy_cloud);
         circle_segmentation.segment (*inliers_circle, *coefficients_circle);  //when doing circle segmentation, coefficients means the x-y coordinate of the found circle
@@ -147,7 +200,7 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
             valid = false;
         // ???
             for (pcl::PointCloud<pcl::PointXYZI>::iterator pt = circle_cloud->points.begin(); pt < circle_cloud->points.end(); ++pt){
-                centroid_cloud_inliers.push_back(*pt);
+                centroid_cloud_inliers.insert(*pt);
             }
         }
         else if(centroid_distance > centroid_dis_max_){
@@ -166,19 +219,9 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
                 }
             }
 
-            // If center is valid, check if any point from wrong_circle belongs to it, and pop it if true
-            // ???
-            for (std::vector<pcl::PointXYZI>::iterator pt = centroid_cloud_inliers.begin(); pt < centroid_cloud_inliers.end(); ++pt)
-            {
-                pcl::PointXYZI schrodinger_pt;
-                schrodinger_pt.x = pt->x;   schrodinger_pt.y = pt->y;   schrodinger_pt.z = pt->z;
-                double distance_to_cluster = sqrt(pow(schrodinger_pt.x-center.x,2) + pow(schrodinger_pt.y-center.y,2) + pow(schrodinger_pt.z-center.z,2));
-                // if(DEBUG) ROS_INFO("Distance to cluster: %lf", distance_to_cluster);
-                if(distance_to_cluster<circle_radius_+0.02){
-                centroid_cloud_inliers.erase(pt);
-                --pt; // To avoid out of range
-                }
-            }
+            // If center is valid, the points set aside that belong to its circle are dropped
+            int removed = centroid_cloud_inliers.removeRadius(center.x, center.y, center.z, circle_radius_ + 0.02);
+            if(DEBUG)   ROS_INFO("%d points set aside belong to this circle, %lu left", removed, centroid_cloud_inliers.size());
         }
 
          if (valid){
@@ -203,6 +246,9 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
 
         if(DEBUG) ROS_INFO("Remaining points in cloud %lu", copy_cloud->points.size());
     }
+
+    if(use_pattern_fit_ && found_centers.size() >= 2)
+        fitPattern(*calib_boundary_, found_centers);
     
     Eigen::Affine3f translation;
     translation.matrix() = Tr_tpl2ukn;
@@ -329,7 +375,8 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
     // }
     pcl::ExtractIndices<pcl::PointXYZI> extract;
     std::vector< std::vector<float> > found_centers;
-    std::vector<pcl::PointXYZI> centroid_cloud_inliers;
+    CirclePointHash centroid_cloud_inliers;     // circle points set aside near the centroid
+    centroid_cloud_inliers.setCellSize(circle_radius_ + 0.02);
     bool valid = true;   // if it is a valid center
 
     while ((copy_cloud->points.size() + centroid_cloud_inliers.size()) > 3 && found_centers.size() < 4 && copy_cloud->points.size())    
@@ -364,7 +411,7 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
             valid = false;
         // ???
             for (pcl::PointCloud<pcl::PointXYZI>::iterator pt = circle_cloud->points.begin(); pt < circle_cloud->points.end(); ++pt){
-                centroid_cloud_inliers.push_back(*pt);
+                centroid_cloud_inliers.insert(*pt);
             }
         }
         else if(centroid_distance > centroid_dis_max_){
@@ -383,21 +430,9 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
                 }
             }
 
-            // If center is valid, check if any point from wrong_circle belongs to it, and pop it if true
-            // ???
-            if(DEBUG)   cout << "In schrodinger_pt" << endl;
-            for (std::vector<pcl::PointXYZI>::iterator pt = centroid_cloud_inliers.begin(); pt < centroid_cloud_inliers.end(); ++pt)
-            {
-                // if(DEBUG)   cout << "In schrodinger_pt" << endl;
-                pcl::PointXYZI schrodinger_pt;
-                schrodinger_pt.x = pt->x;   schrodinger_pt.y = pt->y;   schrodinger_pt.z = pt->z;
-                double distance_to_cluster = sqrt(pow(schrodinger_pt.x-center.x,2) + pow(schrodinger_pt.y-center.y,2) + pow(schrodinger_pt.z-center.z,2));
-                // if(DEBUG) ROS_INFO("Distance to cluster: %lf", distance_to_cluster);
-                if(distance_to_cluster<circle_radius_+0.02){
-                centroid_cloud_inliers.erase(pt);
-                --pt; // To avoid out of range
-                }
-            }
+            // If center is valid, the points set aside that belong to its circle are dropped
+            int removed = centroid_cloud_inliers.removeRadius(center.x, center.y, center.z, circle_radius_ + 0.02);
+            if(DEBUG)   ROS_INFO("%d points set aside belong to this circle, %lu left", removed, centroid_cloud_inliers.size());
         }
 
          if (valid){
@@ -498,5 +533,94 @@ bool FourCircleCenters::FindFourCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &ca
 
 
 
+bool FourCircleCenters::FindTemplateCenters(pcl::PointCloud<pcl::PointXYZI>::Ptr &template_boundary_, pcl::PointCloud<pcl::PointXYZI>::Ptr &circle_center_cloud_,
+                                            const Eigen::Matrix4f& Tr_tpl2ukn, const pcl::PointCloud<pcl::PointXYZI>::Ptr &board_boundary_)
+{
+    if(centers_template_ != template_boundary_)
+    {
+        template_centers_ = pcl::PointCloud<pcl::PointXYZI>::Ptr (new pcl::PointCloud<pcl::PointXYZI>);
+        template_found_ = FindFourCenters(template_boundary_, template_centers_, Eigen::Matrix4f::Identity());
+        if(template_found_)     // a failed extraction is tried again on the next frame
+            centers_template_ = template_boundary_;
+        if(DEBUG) ROS_INFO("[FindTemplateCenters] %d template centers extracted", (int)template_centers_->points.size());
+    }
+
+    Eigen::Affine3f Tr;
+    Tr.matrix() = Tr_tpl2ukn;
+    if(!template_found_)
+    {
+        ROS_WARN("[Laser] Not enough centers: %ld", template_centers_->points.size());
+        pcl::PointCloud<pcl::PointXYZI> centers;
+        pcl::transformPointCloud(*template_centers_, centers, Tr);
+        *circle_center_cloud_ += centers;
+        return false;
+    }
+
+    // ****************** local refinement in the template plane ******************
+    vector<Eigen::Vector2f> centers2d;
+    for(const auto& c : template_centers_->points)
+        centers2d.push_back(Eigen::Vector2f(c.x, c.y));
+    if(refine_centers_ && use_pattern_fit_ && board_boundary_ && !board_boundary_->points.empty())
+    {
+        // the template pattern as a whole, starting from the registered pose
+        Eigen::Affine3f Tr_inv = Tr.inverse();
+        vector<Eigen::Vector2f> pts;
+        for(const auto& p : board_boundary_->points)
+            pts.push_back((Tr_inv * p.getVector3fMap()).head<2>());
+        if(!fitCirclePattern(pattern_fit_, cloud, circle_radius_, circle_seg_thre_, circle_spacing_, 0.0f, found_centers))
+    {
+        if(DEBUG) ROS_INFO("[fitPattern] pattern fit rejected, %d circles seen", pattern_fit_.supportedCircles());
+        return false;
+    }
+    if(DEBUG)
+    {
+        for(size_t k = 0; k < found_centers.size(); k++)
+            ROS_INFO("[fitPattern] center (%f, %f), %d points, sd %f", found_centers[k][0], found_centers[k][1], pattern_fit_.support(k), sqrt(pattern_fit_.centerCovariance(k).trace()));
+    }
+    return true;
+}
+
+
+// The centers found (at least two) give the initial pose of the pattern, which is then fitted to all points of cloud.
+// found_centers is replaced by the four fitted centers if at least three circles are seen in the fit.
+bool FourCircleCenters::fitPattern(const pcl::PointCloud<pcl::PointXYZI>& cloud, std::vector< std::vector<float> >& found_centers)
+{
+    pattern_fit_.setRadius(circle_radius_);
+    pattern_fit_.setDistanceThreshold(circle_seg_thre_);
+    pattern_fit_.setPattern(circle_spacing_, circle_spacing_);
+
+    vector<Eigen::Vector2f> seeds, pts, centers;
+    for(const auto& c : found_centers)
+        seeds.push_back(Eigen::Vector2f(c[0], c[1]));
+    for(const auto& p : cloud.points)
+        pts.push_back(Eigen::Vector2f(p.x, p.y));
+    Eigen::Vector3d pose;
+    if(!pattern_fit_.initialize(seeds, pts, pose) || !pattern_fit_.fit(pts, pose) || pattern_fit_.supportedCircles() < 3)
+    {
+        if(DEBUG) ROS_INFO("[fitPattern] pattern fit rejected, %d circles seen", pattern_fit_.supportedCircles());
+        return false;
+    }
+    pattern_fit_.centers(centers);
+    found_centers.clear();
+    for(size_t k = 0; k < centers.size(); k++)
+    {
+        if(DEBUG) ROS_INFO("[fitPattern] center (%f, %f), %d points, sd %f", centers[k][0], centers[k][1], pattern_fit_.support(k), sqrt(pattern_fit_.centerCovariance(k).trace()));
+        found_centers.push_back(std::vector<float>{centers[k][0], centers[k][1], 0.0f});
+    }
+    return true;
+}
+
+
+void FourCircleCenters::findCentersHough(const pcl::PointCloud<pcl::PointXYZI>& cloud, const pcl::PointXYZI& centroid, std::vector< std::vector<float> >& found_centers)
+{
+    findPatternCirclesHough(hough_, cloud, Eigen::Vector2f(centroid.x, centroid.y), circle_radius_, circle_seg_thre_,
+                            centroid_dis_min_, centroid_dis_max_, 0.0f, found_centers);
+    if(DEBUG)
+    {
+        for(const auto& c : found_centers)
+            cout << "circle center: (" << c[0] << ", " << c[1] << ", " << c[2] << ")" << endl;
+    }
+}
+
 
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+#ifndef FrameArena_H
+#define FrameArena_H
+
+#include <vector>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/PointIndices.h>
+#include <pcl/ModelCoefficients.h>
+#include "SpatialIndex.h"
+
+using namespace std;
+
+template<typename PointT>
+inline void resetBuffer(pcl::PointCloud<PointT>& cloud)
+{
+    cloud.clear();
+    cloud.is_dense = true;
+}
+inline void resetBuffer(pcl::PointIndices& indices) { indices.indices.clear(); }
+inline void resetBuffer(pcl::ModelCoefficients& coeff) { coeff.values.clear(); }
+
+// Buffers of one type that are handed out during a frame and all taken back by reset().
+// A buffer is emptied when handed out but keeps its capacity, so once the pool has grown to
+// the size of a typical frame, acquire() no longer touches the heap.
+template<typename T>
+class BufferPool
+{
+    private:
+        vector<typename T::Ptr> buffers_;
+        size_t used_ = 0;
+
+    public:
+        typename T::Ptr acquire()
+        {
+            if(used_ == buffers_.size())
+                buffers_.push_back(typename T::Ptr(new T));
+            typename T::Ptr& buf = buffers_[used_++];
+            resetBuffer(*buf);
+            return buf;
+        }
+        void reset() { used_ = 0; }
+        size_t used() const { return used_; }
+        size_t size() const { return buffers_.size(); }
+};
+
+// Frame-scoped scratch of one worker thread.
+// Anything acquired here is only valid until the next reset(), i.e. it must not outlive the frame.
+class FrameArena
+{
+    public:
+        BufferPool<pcl::PointCloud<pcl::PointXYZI> > clouds;
+        BufferPool<pcl::PointCloud<pcl::Boundary> > boundaries;
+        BufferPool<pcl::PointIndices> indices;
+        BufferPool<pcl::ModelCoefficients> coefficients;
+        SpatialIndex<pcl::PointXYZI> trees;
+        // plain scratch vectors: cleared or assigned by the stage that uses them, only their capacity carries over
+        vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > transforms;     // PCA hypotheses
+        vector<float> scores;
+        vector<uint8_t> mask;       // points taken by a plane, see extractClusterPlanes()
+
+        void reset()
+        {
+            clouds.reset();
+            boundaries.reset();
+            indices.reset();
+            coefficients.reset();
+            trees.reset();
+        }
+};
+
+#endif
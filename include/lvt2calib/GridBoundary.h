@@ -0,0 +1,181 @@
+#ifndef GridBoundary_H
+#define GridBoundary_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+using namespace std;
+
+// Boundary of a planar point set on a 2D occupancy grid, a stand-in for the kNN pcl::BoundaryEstimation:
+// O(n), no normals and no search tree.
+// The points are projected on two in-plane axes (the PCA axes of the candidate) and binned into square cells.
+// The cell edge starts at the mean point spacing and grows until min_fill_ of the bounding box is occupied,
+// so the gaps between the scan lines of a spinning lidar do not read as holes. The occupancy is then closed
+// by one cell; an occupied cell next to an empty cell of the closed grid lies on the outer border or on the
+// border of a hole, and its outermost point towards every such empty neighbour is a boundary point.
+class GridBoundaryEstimation
+{
+    private:
+        double cell_size_ = 0.0, min_fill_ = 0.5;
+        int max_grow_ = 8;
+        double used_cell_ = 0.0;
+        vector<float> u_, v_;
+        vector<int> point_cell_, cell_start_, cell_points_;
+        vector<uint8_t> occ_, dil_, closed_;
+
+    public:
+        GridBoundaryEstimation(){};
+        ~GridBoundaryEstimation(){};
+
+        // smallest cell edge (m), 0: the mean point spacing
+        void setCellSize(double cell_size) { cell_size_ = cell_size; }
+        // occupied share of the bounding box the cell edge is grown to (at most max_grow_ times by 1.5)
+        void setMinFill(double ratio) { min_fill_ = ratio; }
+        // cell edge of the last compute()
+        double cellSize() const { return used_cell_; }
+
+        // boundaries[i] belongs to cloud[i], as with pcl::BoundaryEstimation
+        template<typename PointT>
+        void compute(const pcl::PointCloud<PointT>& cloud, const Eigen::Vector3f& origin,
+                     const Eigen::Vector3f& axis_u, const Eigen::Vector3f& axis_v, pcl::PointCloud<pcl::Boundary>& boundaries)
+        {
+            const int n = cloud.points.size();
+            boundaries.points.resize(n);
+            boundaries.width = n;
+            boundaries.height = 1;
+            boundaries.is_dense = true;
+            for(int i = 0; i < n; i++)
+                boundaries.points[i].boundary_point = 0;
+
+            // ------ project ------
+            u_.resize(n);   v_.resize(n);
+            float u_min = INFINITY, u_max = -INFINITY, v_min = INFINITY, v_max = -INFINITY;
+            int n_valid = 0;
+            for(int i = 0; i < n; i++)
+            {
+                Eigen::Vector3f d = cloud.points[i].getVector3fMap() - origin;
+                u_[i] = d.dot(axis_u);
+                v_[i] = d.dot(axis_v);
+                if(!isfinite(u_[i]) || !isfinite(v_[i]))
+                {
+                    u_[i] = NAN;
+                    continue;
+                }
+                u_min = min(u_min, u_[i]);  u_max = max(u_max, u_[i]);
+                v_min = min(v_min, v_[i]);  v_max = max(v_max, v_[i]);
+                n_valid++;
+            }
+            if(n_valid <= 3)
+            {
+                for(int i = 0; i < n; i++)
+                    boundaries.points[i].boundary_point = isfinite(u_[i]);
+                used_cell_ = 0.0;
+                return;
+            }
+
+            // ------ cell size and occupancy ------
+            // 2 cells of padding on every side: the closing and the neighbour test need no range checks
+            double h = max(cell_size_, sqrt((double)(u_max - u_min) * (v_max - v_min) / n_valid));
+            h = max(h, 1e-6 * max(u_max - u_min, v_max - v_min));
+            int W = 0, H = 0;
+            for(int grow = 0; ; grow++)
+            {
+                W = (int)((u_max - u_min) / h) + 5;
+                H = (int)((v_max - v_min) / h) + 5;
+                occ_.assign(W * H, 0);
+                point_cell_.resize(n);
+                int n_occ = 0;
+                for(int i = 0; i < n; i++)
+                {
+                    if(!isfinite(u_[i]))
+                    {
+                        point_cell_[i] = -1;
+                        continue;
+                    }
+                    int c = ((int)((v_[i] - v_min) / h) + 2) * W + (int)((u_[i] - u_min) / h) + 2;
+                    point_cell_[i] = c;
+                    n_occ += !occ_[c];
+                    occ_[c] = 1;
+                }
+                if((double)n_occ / ((W - 4) * (H - 4)) >= min_fill_ || grow == max_grow_)
+                    break;
+                h *= 1.5;
+            }
+            used_cell_ = h;
+
+            // ------ closing by one cell ------
+            dil_.assign(W * H, 0);
+            closed_.assign(W * H, 0);
+            for(int y = 1; y < H - 1; y++)
+            {
+                for(int x = 1; x < W - 1; x++)
+                {
+                    int c = y * W + x;
+                    dil_[c] = occ_[c - W - 1] | occ_[c - W] | occ_[c - W + 1] | occ_[c - 1] | occ_[c] | occ_[c + 1]
+                            | occ_[c + W - 1] | occ_[c + W] | occ_[c + W + 1];
+                }
+            }
+            for(int y = 1; y < H - 1; y++)
+            {
+                for(int x = 1; x < W - 1; x++)
+                {
+                    int c = y * W + x;
+                    closed_[c] = dil_[c - W - 1] & dil_[c - W] & dil_[c - W + 1] & dil_[c - 1] & dil_[c] & dil_[c + 1]
+                               & dil_[c + W - 1] & dil_[c + W] & dil_[c + W + 1];
+                }
+            }
+
+            // ------ points by cell ------
+            cell_start_.assign(W * H + 1, 0);
+            for(int i = 0; i < n; i++)
+            {
+                if(point_cell_[i] >= 0)     cell_start_[point_cell_[i] + 1]++;
+            }
+            for(int c = 0; c < W * H; c++)
+                cell_start_[c + 1] += cell_start_[c];
+            cell_points_.resize(cell_start_[W * H]);
+            {
+                vector<int> fill(cell_start_.begin(), cell_start_.end() - 1);
+                for(int i = 0; i < n; i++)
+                {
+                    if(point_cell_[i] >= 0)     cell_points_[fill[point_cell_[i]]++] = i;
+                }
+            }
+
+            // ------ border cells: outermost point towards every empty neighbour ------
+            static const int DU[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+            static const int DV[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+            for(int y = 2; y < H - 2; y++)
+            {
+                for(int x = 2; x < W - 2; x++)
+                {
+                    int c = y * W + x;
+                    if(!occ_[c])    continue;
+                    for(int k = 0; k < 8; k++)
+                    {
+                        if(closed_[c + DV[k] * W + DU[k]])
+                            continue;
+                        int best = -1;
+                        float best_proj = -INFINITY;
+                        for(int j = cell_start_[c]; j < cell_start_[c + 1]; j++)
+                        {
+                            int i = cell_points_[j];
+                            float proj = DU[k] * u_[i] + DV[k] * v_[i];
+                            if(proj > best_proj)
+                            {
+                                best_proj = proj;
+                                best = i;
+                            }
+                        }
+                        boundaries.points[best].boundary_point = 1;
+                    }
+                }
+            }
+        }
+};
+
+#endif
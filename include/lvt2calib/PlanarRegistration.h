@@ -0,0 +1,129 @@
+#ifndef PlanarRegistration_H
+#define PlanarRegistration_H
+
+#include <vector>
+#include <cmath>
+#include <Eigen/Dense>
+#include <pcl/point_cloud.h>
+#include "DistanceField2D.h"
+
+using namespace std;
+
+// In-plane rigid registration (x, y, yaw) of a cloud that already lies in the template plane.
+// Gauss-Newton on point-to-point residuals, with the correspondences read from the template
+// distance field (O(1) per point), so one iteration is a single pass over the source.
+// Motion is restricted to a rotation about the template normal and a translation in the plane.
+template<typename PointT>
+class PlanarRegistration
+{
+    private:
+        const DistanceField2D<PointT>* df_ = nullptr;
+        int max_iter_ = 30;
+        double max_corr_dis_ = 1.0, trans_eps_ = 1e-6;
+
+    public:
+        PlanarRegistration(const DistanceField2D<PointT>& df): df_(&df) {};
+        ~PlanarRegistration(){};
+
+        void setMaximumIterations(int n) { max_iter_ = n; }
+        void setMaxCorrespondenceDistance(double d) { max_corr_dis_ = d; }
+        void setTransformationEpsilon(double eps) { trans_eps_ = eps; }
+
+        // Align source to the template. Tr is the world-frame rigid transform (source -> template),
+        // fitness the mean squared nearest distance after alignment (as pcl::Registration::getFitnessScore).
+        bool align(const pcl::PointCloud<PointT>& source, pcl::PointCloud<PointT>& aligned,
+                    Eigen::Matrix4f& Tr, double& fitness, int* iterations = nullptr) const
+        {
+            const size_t n = source.points.size();
+            if(!df_->valid() || n < 3)
+                return false;
+
+            // ------ source in plane coordinates ------
+            static thread_local vector<Eigen::Vector3f> src_l;
+            src_l.resize(n);
+            for(size_t i = 0; i < n; i++)
+                src_l[i] = df_->toPlane(Eigen::Vector3f(source.points[i].x, source.points[i].y, source.points[i].z));
+
+            const float max_sqr = max_corr_dis_ * max_corr_dis_;
+            double theta = 0.0, tx = 0.0, ty = 0.0;
+            int iter = 0;
+            for(; iter < max_iter_; iter++)
+            {
+                const double c = cos(theta), s = sin(theta);
+                Eigen::Matrix3d H = Eigen::Matrix3d::Zero();
+                Eigen::Vector3d g = Eigen::Vector3d::Zero();
+                int n_corr = 0;
+                for(size_t i = 0; i < n; i++)
+                {
+                    const Eigen::Vector3f& q = src_l[i];
+                    double ax = c * q[0] - s * q[1] + tx;
+                    double ay = s * q[0] + c * q[1] + ty;
+                    float d;
+                    int k = df_->nearestInPlane(Eigen::Vector3f(ax, ay, q[2]), d);
+                    if(k < 0 || d > max_sqr)
+                        continue;
+                    const Eigen::Vector3f& t = df_->sitePlane(k);
+                    double ex = ax - t[0], ey = ay - t[1];
+                    // d(a)/d(theta) = perpendicular of the rotated point
+                    double jx = -(s * q[0] + c * q[1]), jy = c * q[0] - s * q[1];
+                    H(0, 0) += 1.0;     H(0, 2) += jx;
+                    H(1, 1) += 1.0;     H(1, 2) += jy;
+                    H(2, 2) += jx * jx + jy * jy;
+                    g[0] += ex;  g[1] += ey;  g[2] += jx * ex + jy * ey;
+                    n_corr++;
+                }
+                if(n_corr < 3)
+                    return false;
+                H(2, 0) = H(0, 2);
+                H(2, 1) = H(1, 2);
+                Eigen::Vector3d delta = H.ldlt().solve(-g);
+                if(!delta.allFinite())
+                    return false;
+                tx += delta[0];
+                ty += delta[1];
+                theta += delta[2];
+                if(delta.squaredNorm() < trans_eps_ * trans_eps_)
+                {
+                    iter++;
+                    break;
+                }
+            }
+            // like pcl ICP, running out of iterations is not a failure
+            if(iterations)  *iterations = iter;
+
+            // ------ back to the world frame: Tr = A^-1 * T_plane * A ------
+            Eigen::Matrix4f A = Eigen::Matrix4f::Identity(), T_plane = Eigen::Matrix4f::Identity();
+            A.block<3, 3>(0, 0) = df_->planeRotation();
+            A.block<3, 1>(0, 3) = -df_->planeRotation() * df_->planeOrigin();
+            T_plane(0, 0) = cos(theta);  T_plane(0, 1) = -sin(theta);
+            T_plane(1, 0) = sin(theta);  T_plane(1, 1) = cos(theta);
+            T_plane(0, 3) = tx;
+            T_plane(1, 3) = ty;
+            Tr = A.inverse() * T_plane * A;
+
+            // ------ aligned cloud and fitness ------
+            aligned.points.resize(n);
+            const double c = cos(theta), s = sin(theta);
+            double sum = 0.0;
+            for(size_t i = 0; i < n; i++)
+            {
+                const Eigen::Vector3f& q = src_l[i];
+                Eigen::Vector3f a(c * q[0] - s * q[1] + tx, s * q[0] + c * q[1] + ty, q[2]);
+                float d;
+                df_->nearestInPlane(a, d);
+                sum += d;
+                Eigen::Vector3f p = df_->planeRotation().transpose() * a + df_->planeOrigin();
+                aligned.points[i] = source.points[i];
+                aligned.points[i].x = p[0];
+                aligned.points[i].y = p[1];
+                aligned.points[i].z = p[2];
+            }
+            aligned.width = n;
+            aligned.height = 1;
+            aligned.is_dense = source.is_dense;
+            fitness = sum / n;
+            return true;
+        }
+};
+
+#endif
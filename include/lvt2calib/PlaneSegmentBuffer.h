@@ -0,0 +1,111 @@
+#ifndef PlaneSegmentBuffer_H
+#define PlaneSegmentBuffer_H
+
+#include <vector>
+#include <algorithm>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+using namespace std;
+
+// Debug store for the segmented planes of the last N frames, each point labelled with its segment number.
+// Every frame slot has a fixed point capacity reserved up front and is cleared (not freed) when reused,
+// so memory use and the size of the published cloud do not grow with the length of a session.
+class PlaneSegmentBuffer
+{
+    public:
+        typedef pcl::PointCloud<pcl::PointXYZI> CloudT;
+
+    private:
+        vector<CloudT::Ptr> frames_;    // ring of per-frame slots
+        CloudT::Ptr history_cloud_;     // concatenation of the ring, only used when history > 1
+        size_t capacity_ = 100000;      // max points kept per frame
+        int head_ = 0, filled_ = 0;
+        size_t dropped_ = 0;
+
+        void allocate(int history)
+        {
+            frames_.clear();
+            for(int i = 0; i < history; i++)
+            {
+                frames_.push_back(CloudT::Ptr(new CloudT));
+                frames_.back()->points.reserve(capacity_);
+            }
+            history_cloud_ = CloudT::Ptr(new CloudT);
+            if(history > 1)
+                history_cloud_->points.reserve(capacity_ * history);
+            head_ = 0;
+            filled_ = 0;
+        }
+
+    public:
+        PlaneSegmentBuffer(int history = 1)
+        {
+            allocate(max(history, 1));
+        };
+        ~PlaneSegmentBuffer(){};
+
+        void setHistory(int n)
+        {
+            n = max(n, 1);
+            if(n != (int)frames_.size())
+                allocate(n);
+        }
+        void setCapacity(size_t n)
+        {
+            if(n == capacity_)
+                return;
+            capacity_ = n;
+            allocate(frames_.size());
+        }
+        int history() const { return frames_.size(); }
+        // number of points cut off in the current frame because the slot was full
+        size_t dropped() const { return dropped_; }
+
+        // Move to the next ring slot and empty it, keeping its storage.
+        void beginFrame()
+        {
+            head_ = (head_ + 1) % frames_.size();
+            filled_ = min(filled_ + 1, (int)frames_.size());
+            frames_[head_]->clear();
+            dropped_ = 0;
+        }
+
+        // Append one segment with every point's intensity set to label.
+        void addSegment(const CloudT& segment, float label)
+        {
+            CloudT& cur = *frames_[head_];
+            size_t base = cur.points.size();
+            size_t n = min(segment.points.size(), capacity_ - base);
+            dropped_ += segment.points.size() - n;
+            cur.points.resize(base + n);
+            for(size_t k = 0; k < n; k++)
+            {
+                cur.points[base + k] = segment.points[k];
+                cur.points[base + k].intensity = label;
+            }
+            cur.width = cur.points.size();
+            cur.height = 1;
+            cur.is_dense = segment.is_dense;
+        }
+
+        CloudT::Ptr& current() { return frames_[head_]; }
+
+        // The current frame, or the last N frames (oldest first) when a history is kept.
+        CloudT::Ptr& output()
+        {
+            if(frames_.size() == 1)
+                return frames_[head_];
+            history_cloud_->clear();
+            for(int i = filled_ - 1; i >= 0; i--)
+            {
+                const CloudT& f = *frames_[(head_ - i + (int)frames_.size()) % (int)frames_.size()];
+                history_cloud_->points.insert(history_cloud_->points.end(), f.points.begin(), f.points.end());
+            }
+            history_cloud_->width = history_cloud_->points.size();
+            history_cloud_->height = 1;
+            return history_cloud_;
+        }
+};
+
+#endif
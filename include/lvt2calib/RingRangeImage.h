@@ -0,0 +1,395 @@
+#ifndef RingRangeImage_H
+#define RingRangeImage_H
+
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/PointIndices.h>
+
+using namespace std;
+
+// Working buffers of the RingRangeImage passes. Owned by the caller and handed to every call, so their capacity
+// carries over from frame to frame; one per thread that runs the passes.
+struct RangeImageScratch
+{
+    vector<double> sat;             // computeNormals(): summed-area tables
+    vector<int> label, queue;       // cluster()
+    vector<int> order, seeds;       // growRegions()
+    vector<uint8_t> labelled;
+    vector<int> perm;               // sorting the clusters by size
+};
+
+// Organized view of a ring-based lidar frame (Velodyne, Ouster): rings x azimuth bins, every pixel holding the
+// index of its point in the frame (the nearest one if several fall in the same bin). It does not copy the points,
+// so it serves any cloud with the same point order, e.g. the PointXYZI copy the detector works on.
+// Neighbours are found in the image instead of a KD-tree: a point's neighbours are the pixels in a window of
+// rings x columns around it, the columns wrapping around at 360 deg.
+class RingRangeImage
+{
+    private:
+        int rings_ = 0, cols_ = 0;
+        float col_res_ = 0.0f;      // azimuth per column (rad)
+        vector<int> pixel_point_;   // ring * cols_ + col -> point index, -1 if empty
+        vector<int> point_pixel_;   // point index -> pixel, -1 if the point is not in the image
+        vector<float> range_;       // per pixel
+
+        int col(int c) const { return (c % cols_ + cols_) % cols_; }
+
+        // clusters[n], emptied; an element left from the last frame keeps the capacity of its indices
+        static pcl::PointIndices& nextCluster(vector<pcl::PointIndices>& clusters, int n)
+        {
+            if((int)clusters.size() <= n)
+                clusters.emplace_back();
+            clusters[n].indices.clear();
+            return clusters[n];
+        }
+        // Keep clusters[0, n), sorted by size, largest first, in order of discovery among equal sizes
+        // (as stable_sort, without its buffer). The permutation is applied in place by swapping.
+        static void sortClusters(vector<pcl::PointIndices>& clusters, int n, vector<int>& perm)
+        {
+            clusters.resize(n);
+            perm.resize(n);
+            for(int i = 0; i < n; i++)  perm[i] = i;
+            sort(perm.begin(), perm.end(), [&](int a, int b)
+            {
+                size_t sa = clusters[a].indices.size(), sb = clusters[b].indices.size();
+                return sa != sb ? sa > sb : a < b;
+            });
+            // position k takes the cluster at perm[k]
+            for(int i = 0; i < n; i++)
+            {
+                if(perm[i] < 0)     continue;
+                int cur = i;
+                while(perm[cur] != i)
+                {
+                    int next = perm[cur];
+                    swap(clusters[cur], clusters[next]);
+                    perm[cur] = -1;
+                    cur = next;
+                }
+                perm[cur] = -1;
+            }
+        }
+
+    public:
+        RingRangeImage(){};
+        ~RingRangeImage(){};
+
+        // cloud: points with a ring field in [0, rings), cols: azimuth bins per revolution
+        template<typename PointT>
+        void build(const pcl::PointCloud<PointT>& cloud, int rings, int cols)
+        {
+            rings_ = rings;
+            cols_ = cols;
+            col_res_ = 2.0 * M_PI / cols;
+            const int n = cloud.points.size();
+            pixel_point_.assign(rings_ * cols_, -1);
+            range_.assign(rings_ * cols_, FLT_MAX);
+            point_pixel_.assign(n, -1);
+            for(int i = 0; i < n; i++)
+            {
+                const PointT& p = cloud.points[i];
+                if(!isfinite(p.x) || !isfinite(p.y) || !isfinite(p.z) || (int)p.ring >= rings_)
+                    continue;
+                float range = sqrt(p.x * p.x + p.y * p.y + p.z * p.z);
+                int c = min(cols_ - 1, (int)((atan2(p.y, p.x) + M_PI) / col_res_));
+                int pix = p.ring * cols_ + c;
+                if(range >= range_[pix])
+                    continue;
+                if(pixel_point_[pix] >= 0)  point_pixel_[pixel_point_[pix]] = -1;
+                pixel_point_[pix] = i;
+                point_pixel_[i] = pix;
+                range_[pix] = range;
+            }
+        }
+
+        int rings() const { return rings_; }
+        int cols() const { return cols_; }
+        size_t points() const { return point_pixel_.size(); }
+        int point(int ring, int c) const { return pixel_point_[ring * cols_ + col(c)]; }
+        int pixel(int i) const { return point_pixel_[i]; }
+        float range(int ring, int c) const { return range_[ring * cols_ + col(c)]; }
+
+        // take the points for which remove(i) is true out of the image
+        template<typename Pred>
+        void removePoints(Pred remove)
+        {
+            for(size_t pix = 0; pix < pixel_point_.size(); pix++)
+            {
+                int i = pixel_point_[pix];
+                if(i < 0 || !remove(i))     continue;
+                pixel_point_[pix] = -1;
+                point_pixel_[i] = -1;
+                range_[pix] = FLT_MAX;
+            }
+        }
+
+        // f(j) for every point j != i of the image within +-win_r rings and +-win_c columns of point i
+        template<typename F>
+        void forNeighbours(int i, int win_r, int win_c, F f) const
+        {
+            const int pix = point_pixel_[i];
+            if(pix < 0)     return;
+            const int r0 = pix / cols_, c0 = pix % cols_;
+            for(int r = max(0, r0 - win_r); r <= min(rings_ - 1, r0 + win_r); r++)
+            {
+                for(int dc = -win_c; dc <= win_c; dc++)
+                {
+                    int j = pixel_point_[r * cols_ + col(c0 + dc)];
+                    if(j >= 0 && j != i)    f(j);
+                }
+            }
+        }
+
+        // Gaussian smoothing of the positions over the image neighbours within radius (weights exp(-d^2 / 2 sigma^2)).
+        // The column window follows the range, so it spans about radius at any distance. Only points with mask[i] != 0
+        // are smoothed and used (all image points if mask is null); the others are copied.
+        template<typename PointT>
+        void smooth(const pcl::PointCloud<PointT>& cloud_in, pcl::PointCloud<PointT>& cloud_out, double sigma, double radius,
+                    const vector<uint8_t>* mask = nullptr, int max_win_c = 8) const
+        {
+            cloud_out = cloud_in;
+            const float sqr_radius = radius * radius, inv_2sigma2 = 1.0 / (2.0 * sigma * sigma);
+            for(size_t i = 0; i < cloud_in.points.size(); i++)
+            {
+                const int pix = point_pixel_[i];
+                if(pix < 0 || (mask && !(*mask)[i]))     continue;
+                const PointT& p = cloud_in.points[i];
+                int win_c = min(max_win_c, (int)ceil(radius / (range_[pix] * col_res_)));
+                double w_sum = 1.0, x = p.x, y = p.y, z = p.z;
+                forNeighbours(i, 1, win_c, [&](int j)
+                {
+                    if(mask && !(*mask)[j])     return;
+                    const PointT& q = cloud_in.points[j];
+                    float dx = q.x - p.x, dy = q.y - p.y, dz = q.z - p.z;
+                    float d2 = dx * dx + dy * dy + dz * dz;
+                    if(d2 > sqr_radius)     return;
+                    double w = exp(-d2 * inv_2sigma2);
+                    x += w * q.x;   y += w * q.y;   z += w * q.z;
+                    w_sum += w;
+                });
+                cloud_out.points[i].x = x / w_sum;
+                cloud_out.points[i].y = y / w_sum;
+                cloud_out.points[i].z = z / w_sum;
+            }
+        }
+
+        // Connected components of the image: neighbouring pixels (+-1 ring, +-win_c columns) belong to the same
+        // cluster if their ranges differ by at most range_thre. Only points with mask[i] != 0 take part.
+        // As with EuclideanClusterExtraction: clusters outside [min_size, max_size] are dropped, the indices are
+        // ascending and the clusters sorted by size, largest first.
+        void cluster(const vector<uint8_t>& mask, double range_thre, int min_size, int max_size,
+                     vector<pcl::PointIndices>& clusters, RangeImageScratch& scratch, int win_c = 2) const
+        {
+            vector<int>& label = scratch.label;
+            vector<int>& queue = scratch.queue;
+            label.assign(pixel_point_.size(), -1);
+            int n_labels = 0, n_clusters = 0;
+            for(size_t seed = 0; seed < pixel_point_.size(); seed++)
+            {
+                if(pixel_point_[seed] < 0 || !mask[pixel_point_[seed]] || label[seed] >= 0)
+                    continue;
+                pcl::PointIndices& component = nextCluster(clusters, n_clusters);
+                queue.clear();
+                queue.push_back(seed);
+                label[seed] = n_labels;
+                for(size_t q = 0; q < queue.size(); q++)
+                {
+                    const int pix = queue[q];
+                    const int i = pixel_point_[pix];
+                    component.indices.push_back(i);
+                    forNeighbours(i, 1, win_c, [&](int j)
+                    {
+                        int pj = point_pixel_[j];
+                        if(label[pj] >= 0 || !mask[j] || fabs(range_[pj] - range_[pix]) > range_thre)
+                            return;
+                        label[pj] = n_labels;
+                        queue.push_back(pj);
+                    });
+                }
+                n_labels++;
+                if((int)component.indices.size() < min_size || (int)component.indices.size() > max_size)
+                    continue;
+                sort(component.indices.begin(), component.indices.end());
+                n_clusters++;
+            }
+            sortClusters(clusters, n_clusters, scratch.perm);
+        }
+
+        // Normals from integral images: the covariance of the points in the (2 win_r + 1) x (2 win_c + 1) pixel box
+        // around every point is read from summed-area tables of the coordinates and their products, so each normal
+        // costs O(1) whatever the box size. Where the box straddles a depth edge (the range moments of the box
+        // deviate from the point's range by more than depth_thre) the box is summed directly over the points within
+        // depth_thre of the point's range instead, so the board rim does not take the background into its normal.
+        // Normal: smallest eigenvector, pointing to the sensor; curvature: lambda_0 / (lambda_0 + lambda_1 + lambda_2),
+        // as pcl::NormalEstimation. Points with fewer than min_points in their box, or a box that is not spread in
+        // two directions, get a NaN normal. Only points with mask[i] != 0 take part (all image points if mask is null).
+        template<typename PointT>
+        void computeNormals(const pcl::PointCloud<PointT>& cloud, pcl::PointCloud<pcl::Normal>& normals, RangeImageScratch& scratch,
+                            double depth_thre, int win_r = 1, int win_c = 3, int min_points = 5, const vector<uint8_t>* mask = nullptr) const
+        {
+            static const int CH = 12;  // 0: count, 1-3: x y z, 4-9: xx xy xz yy yz zz, 10-11: range, range^2
+            const float nan = numeric_limits<float>::quiet_NaN();
+            const int W = cols_ + 1;
+            auto moments = [&](int i, double* v)
+            {
+                const PointT& p = cloud.points[i];
+                double x = p.x, y = p.y, z = p.z, rg = range_[point_pixel_[i]];
+                v[0] = 1;   v[1] = x;       v[2] = y;       v[3] = z;
+                v[4] = x * x;   v[5] = x * y;   v[6] = x * z;   v[7] = y * y;   v[8] = y * z;   v[9] = z * z;
+                v[10] = rg;     v[11] = rg * rg;
+            };
+            vector<double>& sat = scratch.sat;
+            sat.assign((size_t)(rings_ + 1) * W * CH, 0.0);
+            auto cell = [&](int r, int c) { return &sat[((size_t)r * W + c) * CH]; };
+            for(int r = 0; r < rings_; r++)
+            {
+                for(int c = 0; c < cols_; c++)
+                {
+                    double v[CH] = {0};
+                    int i = pixel_point_[r * cols_ + c];
+                    if(i >= 0 && (!mask || (*mask)[i]))
+                        moments(i, v);
+                    double *out = cell(r + 1, c + 1), *up = cell(r, c + 1), *left = cell(r + 1, c), *diag = cell(r, c);
+                    for(int k = 0; k < CH; k++)
+                        out[k] = v[k] + up[k] + left[k] - diag[k];
+                }
+            }
+
+            normals.points.resize(cloud.points.size());
+            normals.width = cloud.points.size();
+            normals.height = 1;
+            normals.is_dense = false;
+            for(size_t i = 0; i < cloud.points.size(); i++)
+            {
+                pcl::Normal& nrm = normals.points[i];
+                nrm.normal_x = nrm.normal_y = nrm.normal_z = nrm.curvature = nan;
+                const int pix = point_pixel_[i];
+                if(pix < 0 || (mask && !(*mask)[i]))    continue;
+                const int r = pix / cols_, c = pix % cols_;
+                const int r0 = max(0, r - win_r), r1 = min(rings_ - 1, r + win_r);
+                const int c0 = max(0, c - win_c), c1 = min(cols_ - 1, c + win_c);
+                const double *a = cell(r1 + 1, c1 + 1), *b = cell(r0, c1 + 1), *d = cell(r1 + 1, c0), *e = cell(r0, c0);
+                double m[CH];
+                for(int k = 0; k < CH; k++)
+                    m[k] = a[k] - b[k] - d[k] + e[k];
+
+                // ------ depth edge in the box: sum the points near the point's range only ------
+                const double range_i = range_[pix];
+                double mean_range = m[10] / m[0], var_range = max(0.0, m[11] / m[0] - mean_range * mean_range);
+                if(fabs(mean_range - range_i) + sqrt(var_range) > depth_thre)
+                {
+                    for(int k = 0; k < CH; k++)     m[k] = 0.0;
+                    for(int rr = r0; rr <= r1; rr++)
+                    {
+                        for(int cc = c0; cc <= c1; cc++)
+                        {
+                            int j = pixel_point_[rr * cols_ + cc];
+                            if(j < 0 || (mask && !(*mask)[j]) || fabs(range_[rr * cols_ + cc] - range_i) > depth_thre)
+                                continue;
+                            double v[CH];
+                            moments(j, v);
+                            for(int k = 0; k < CH; k++)     m[k] += v[k];
+                        }
+                    }
+                }
+                if(m[0] < min_points)   continue;
+
+                const double inv_n = 1.0 / m[0];
+                Eigen::Vector3d mean(m[1] * inv_n, m[2] * inv_n, m[3] * inv_n);
+                Eigen::Matrix3d cov;
+                cov(0, 0) = m[4] * inv_n - mean[0] * mean[0];
+                cov(0, 1) = cov(1, 0) = m[5] * inv_n - mean[0] * mean[1];
+                cov(0, 2) = cov(2, 0) = m[6] * inv_n - mean[0] * mean[2];
+                cov(1, 1) = m[7] * inv_n - mean[1] * mean[1];
+                cov(1, 2) = cov(2, 1) = m[8] * inv_n - mean[1] * mean[2];
+                cov(2, 2) = m[9] * inv_n - mean[2] * mean[2];
+                Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(cov);
+                const Eigen::Vector3d& lambda = es.eigenvalues();
+                if(lambda[1] <= 1e-12 * max(1.0, lambda[2]))     continue;   // points on a line
+                Eigen::Vector3d n = es.eigenvectors().col(0);
+                if(n.dot(cloud.points[i].getVector3fMap().template cast<double>()) > 0)     n = -n;
+                nrm.normal_x = n[0];
+                nrm.normal_y = n[1];
+                nrm.normal_z = n[2];
+                double sum = lambda.sum();
+                nrm.curvature = sum > 0 ? max(0.0, lambda[0]) / sum : 0.0;
+            }
+        }
+
+        // Region growing over the image neighbours (+-1 ring, +-win_c columns), as pcl::RegionGrowing: seeds are
+        // taken by increasing curvature, a neighbour joins if its normal is within smooth_thre (rad) of the normal
+        // of the point it is reached from and its range differs by at most range_thre, and it grows the region
+        // further if its curvature is below curvature_thre. Points with a NaN normal or mask[i] == 0 are left out.
+        // Regions outside [min_size, max_size] are dropped; indices ascending, regions by size, largest first.
+        template<typename PointT>
+        void growRegions(const pcl::PointCloud<PointT>& cloud, const pcl::PointCloud<pcl::Normal>& normals, const vector<uint8_t>& mask,
+                         double smooth_thre, double curvature_thre, double range_thre, int min_size, int max_size,
+                         vector<pcl::PointIndices>& regions, RangeImageScratch& scratch, int win_c = 2) const
+        {
+            const int n = cloud.points.size();
+            const float cos_thre = cos(smooth_thre);
+            auto usable = [&](int i)
+            {
+                const pcl::Normal& nrm = normals.points[i];
+                return point_pixel_[i] >= 0 && mask[i] && isfinite(nrm.normal_x) && isfinite(nrm.curvature);
+            };
+            vector<int>& order = scratch.order;
+            vector<int>& seeds = scratch.seeds;
+            vector<uint8_t>& labelled = scratch.labelled;
+            order.clear();
+            for(int i = 0; i < n; i++)
+            {
+                if(usable(i))   order.push_back(i);
+            }
+            // by curvature, ties by index: the order stable_sort gives, without its buffer
+            sort(order.begin(), order.end(), [&](int a, int b)
+            {
+                float ca = normals.points[a].curvature, cb = normals.points[b].curvature;
+                return ca != cb ? ca < cb : a < b;
+            });
+
+            labelled.assign(n, 0);
+            int n_regions = 0;
+            for(int s : order)
+            {
+                if(labelled[s])     continue;
+                pcl::PointIndices& region = nextCluster(regions, n_regions);
+                seeds.clear();
+                seeds.push_back(s);
+                labelled[s] = 1;
+                region.indices.push_back(s);
+                for(size_t q = 0; q < seeds.size(); q++)
+                {
+                    const int i = seeds[q];
+                    const pcl::Normal& ni = normals.points[i];
+                    const float range_i = range_[point_pixel_[i]];
+                    forNeighbours(i, 1, win_c, [&](int j)
+                    {
+                        if(labelled[j] || !usable(j))   return;
+                        const pcl::Normal& nj = normals.points[j];
+                        if(fabs(ni.normal_x * nj.normal_x + ni.normal_y * nj.normal_y + ni.normal_z * nj.normal_z) < cos_thre)
+                            return;
+                        if(fabs(range_[point_pixel_[j]] - range_i) > range_thre)
+                            return;
+                        labelled[j] = 1;
+                        region.indices.push_back(j);
+                        if(nj.curvature < curvature_thre)
+                            seeds.push_back(j);
+                    });
+                }
+                if((int)region.indices.size() < min_size || (int)region.indices.size() > max_size)
+                    continue;
+                sort(region.indices.begin(), region.indices.end());
+                n_regions++;
+            }
+            sortClusters(regions, n_regions, scratch.perm);
+        }
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef SpatialIndex_H
+#define SpatialIndex_H
+
+#include <vector>
+#include <pcl/point_cloud.h>
+#include <pcl/search/kdtree.h>
+
+using namespace std;
+
+// pcl::search::KdTree that is built once per point set.
+// PCL algorithms (NormalEstimation, BoundaryEstimation, RegionGrowing, Convolution3D, EuclideanClusterExtraction)
+// call setInputCloud() on their search method every time they run, which rebuilds a plain KdTree.
+// This one ignores the call when it already holds the same cloud and the same index subset
+// (the full identity index list PCL creates when no indices are given counts as no subset).
+// The point set must not be changed in place while the tree is in use; invalidate() forces a rebuild.
+template<typename PointT>
+class CachedKdTree: public pcl::search::KdTree<PointT>
+{
+    public:
+        typedef typename pcl::search::KdTree<PointT>::PointCloudConstPtr PointCloudConstPtr;
+        typedef typename pcl::search::KdTree<PointT>::IndicesConstPtr IndicesConstPtr;
+
+    private:
+        bool built_ = false;
+        size_t built_size_ = 0;
+
+        static bool isFullIndices(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices)
+        {
+            if(!indices)    return true;
+            if(indices->size() != cloud->points.size()) return false;
+            for(size_t i = 0; i < indices->size(); i++)
+            {
+                if((*indices)[i] != (int)i)     return false;
+            }
+            return true;
+        }
+
+    public:
+        CachedKdTree(bool sorted = true): pcl::search::KdTree<PointT>(sorted) {};
+        ~CachedKdTree(){};
+
+        void invalidate() { built_ = false; }
+
+        bool holds(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices = IndicesConstPtr()) const
+        {
+            if(!built_ || cloud != this->input_ || cloud->points.size() != built_size_)
+                return false;
+            if(indices == this->indices_)
+                return true;
+            return isFullIndices(cloud, indices) && isFullIndices(cloud, this->indices_);
+        }
+
+        void setInputCloud(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices = IndicesConstPtr()) override
+        {
+            if(holds(cloud, indices))
+                return;
+            pcl::search::KdTree<PointT>::setInputCloud(cloud, isFullIndices(cloud, indices) ? IndicesConstPtr() : indices);
+            built_ = true;
+            built_size_ = cloud->points.size();
+        }
+};
+
+// Search trees of one frame: get() hands out the tree of a point set (or an index subset of it, without
+// copying the points), building it on first use. Stages that search the same set share one build.
+// reset() at the start of every frame, the buffers behind the trees are reused from frame to frame.
+template<typename PointT>
+class SpatialIndex
+{
+    public:
+        typedef typename pcl::search::KdTree<PointT>::Ptr TreePtr;
+        typedef typename CachedKdTree<PointT>::PointCloudConstPtr PointCloudConstPtr;
+        typedef typename CachedKdTree<PointT>::IndicesConstPtr IndicesConstPtr;
+
+    private:
+        vector<TreePtr> trees_;
+        vector<CachedKdTree<PointT>*> cached_;
+        size_t used_ = 0;
+
+    public:
+        TreePtr get(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices = IndicesConstPtr())
+        {
+            for(size_t i = 0; i < used_; i++)
+            {
+                if(cached_[i]->holds(cloud, indices))
+                    return trees_[i];
+            }
+            TreePtr tree = acquire();
+            tree->setInputCloud(cloud, indices);
+            return tree;
+        }
+        // an empty tree for a stage that sets its input itself
+        TreePtr acquire()
+        {
+            if(used_ == trees_.size())
+            {
+                CachedKdTree<PointT>* tree = new CachedKdTree<PointT>;
+                trees_.push_back(TreePtr(tree));
+                cached_.push_back(tree);
+            }
+            cached_[used_]->invalidate();
+            return trees_[used_++];
+        }
+        void reset()
+        {
+            for(size_t i = 0; i < used_; i++)
+                cached_[i]->invalidate();
+            used_ = 0;
+        }
+        size_t used() const { return used_; }
+};
+
+#endif
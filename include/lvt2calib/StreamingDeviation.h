@@ -0,0 +1,37 @@
+#ifndef StreamingDeviation_H
+#define StreamingDeviation_H
+
+#include <cmath>
+#include <cstddef>
+
+// Running population standard deviation (Welford), the value CalculateRMSE() computes from a whole vector.
+class StreamingDeviation
+{
+    private:
+        size_t n_ = 0;
+        double mean_ = 0.0, m2_ = 0.0;  // m2_: sum of squared deviations from the running mean
+
+    public:
+        void reset()
+        {
+            n_ = 0;
+            mean_ = m2_ = 0.0;
+        }
+        inline void add(double x)
+        {
+            n_++;
+            double d = x - mean_;
+            mean_ += d / n_;
+            m2_ += d * (x - mean_);
+        }
+        size_t count() const { return n_; }
+        double mean() const { return mean_; }
+        double deviation() const { return sqrt(m2_ / n_); }
+
+        // Once n_total samples are in, the deviation is at least this: m2_ never decreases as samples are added.
+        double lowerBound(size_t n_total) const { return sqrt(m2_ / n_total); }
+        // true if the deviation over n_total samples is already certain to exceed thre
+        inline bool exceeds(double thre, size_t n_total) const { return m2_ > thre * thre * n_total; }
+};
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef ThreadPool_H
+#define ThreadPool_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+using namespace std;
+
+// Small work-stealing pool for data-parallel loops.
+// Every participant (the calling thread is worker 0) owns a task deque: it pops its own tasks
+// from the back and steals from the front of the others' deques once it runs dry.
+// parallelFor() called from inside a task of the same pool runs inline, so nesting cannot deadlock.
+class ThreadPool
+{
+    private:
+        struct WorkQueue
+        {
+            mutex mtx;
+            deque<int> tasks;
+        };
+
+        vector<thread> workers_;
+        vector<unique_ptr<WorkQueue> > queues_;
+        function<void(int, int)> job_;
+
+        mutex mtx_;
+        condition_variable cv_start_, cv_done_;
+        unsigned long generation_ = 0;
+        atomic<int> pending_;
+        bool stop_ = false;
+
+        static const ThreadPool*& tlsOwner() { static thread_local const ThreadPool* owner = nullptr; return owner; }
+        static int& tlsWorkerId() { static thread_local int id = 0; return id; }
+
+        bool popTask(int worker, int& task)
+        {
+            {
+                WorkQueue& q = *queues_[worker];
+                lock_guard<mutex> lk(q.mtx);
+                if(!q.tasks.empty())
+                {
+                    task = q.tasks.back();
+                    q.tasks.pop_back();
+                    return true;
+                }
+            }
+            for(size_t k = 1; k < queues_.size(); k++)
+            {
+                WorkQueue& q = *queues_[(worker + k) % queues_.size()];
+                lock_guard<mutex> lk(q.mtx);
+                if(!q.tasks.empty())
+                {
+                    task = q.tasks.front();
+                    q.tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void runTasks(int worker)
+        {
+            int task;
+            while(popTask(worker, task))
+            {
+                job_(task, worker);
+                if(pending_.fetch_sub(1) == 1)
+                {
+                    lock_guard<mutex> lk(mtx_);
+                    cv_done_.notify_all();
+                }
+            }
+        }
+
+        void workerLoop(int worker)
+        {
+            tlsOwner() = this;
+            tlsWorkerId() = worker;
+            unsigned long seen = 0;
+            while(true)
+            {
+                {
+                    unique_lock<mutex> lk(mtx_);
+                    cv_start_.wait(lk, [&]{ return stop_ || generation_ != seen; });
+                    if(stop_)   return;
+                    seen = generation_;
+                }
+                runTasks(worker);
+            }
+        }
+
+        void stopWorkers()
+        {
+            {
+                lock_guard<mutex> lk(mtx_);
+                stop_ = true;
+            }
+            cv_start_.notify_all();
+            for(auto& w : workers_)
+                w.join();
+            workers_.clear();
+            stop_ = false;
+        }
+
+    public:
+        ThreadPool(int num_threads = 1)
+        {
+            pending_ = 0;
+            resize(num_threads);
+        }
+        ~ThreadPool()
+        {
+            stopWorkers();
+        }
+
+        // Total number of participants, including the calling thread.
+        int size() const { return (int)queues_.size(); }
+
+        void resize(int num_threads)
+        {
+            if(num_threads < 1)
+                num_threads = 1;
+            if(num_threads == size())
+                return;
+            stopWorkers();
+            queues_.clear();
+            for(int i = 0; i < num_threads; i++)
+                queues_.emplace_back(new WorkQueue);
+            for(int i = 1; i < num_threads; i++)
+                workers_.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+
+        // Run fn(task_idx, worker_idx) for every task_idx in [0, n) and wait for all of them.
+        // worker_idx is in [0, size()) and is stable for the duration of one task, so it can index per-worker scratch.
+        template<typename Fn>
+        void parallelFor(int n, Fn fn)
+        {
+            if(n <= 0)  return;
+            if(workers_.empty() || n == 1 || tlsOwner() == this)
+            {
+                int worker = (tlsOwner() == this) ? tlsWorkerId() : 0;
+                for(int i = 0; i < n; i++)
+                    fn(i, worker);
+                return;
+            }
+
+            job_ = fn;
+            pending_ = n;
+            for(int i = 0; i < n; i++)
+            {
+                WorkQueue& q = *queues_[i % queues_.size()];
+                lock_guard<mutex> lk(q.mtx);
+                q.tasks.push_front(i);
+            }
+            {
+                lock_guard<mutex> lk(mtx_);
+                generation_++;
+            }
+            cv_start_.notify_all();
+
+            tlsOwner() = this;
+            tlsWorkerId() = 0;
+            runTasks(0);
+            tlsOwner() = nullptr;
+
+            unique_lock<mutex> lk(mtx_);
+            cv_done_.wait(lk, [&]{ return pending_.load() == 0; });
+        }
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef VoxelCluster_H
+#define VoxelCluster_H
+
+#include <vector>
+#include <cmath>
+#include <climits>
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <unordered_map>
+#include <pcl/point_cloud.h>
+#include <pcl/PointIndices.h>
+#include "VoxelHash.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+// Euclidean clustering on a voxel hash, a drop-in for pcl::EuclideanClusterExtraction.
+// Voxels have an edge of tolerance / sqrt(3), so all points of one voxel are within tolerance of each other
+// and the voxel is the union-find node. Two voxels can only hold points within tolerance if they are at most
+// 2 voxels apart on every axis; such pairs are joined if any point pair across them is within tolerance.
+// That exact test runs only while the two voxels are still in different components, so within a dense
+// region it is mostly skipped. Voxels are processed in parallel blocks on a lock-free union-find.
+// The clusters are the same as EuclideanClusterExtraction's: indices ascending, clusters by size descending.
+class VoxelClusterExtraction
+{
+    private:
+        double tolerance_ = 0.05;
+        int min_size_ = 1, max_size_ = INT_MAX;
+
+        unordered_map<VoxelKey, int, VoxelKeyHash> key2voxel_;
+        vector<VoxelKey> voxel_keys_;
+        vector<int> point_voxel_;       // voxel of every point, -1 for non-finite points
+        vector<int> voxel_start_;       // points of voxel v are [voxel_start_[v], voxel_start_[v+1]) in px_, py_, pz_
+        vector<float> px_, py_, pz_;    // point coordinates grouped by voxel
+        unique_ptr<atomic<int>[]> parent_;
+        size_t parent_cap_ = 0;
+        vector<int> root_size_, root_cluster_;
+
+        int find(int x)
+        {
+            while(true)
+            {
+                int p = parent_[x].load(memory_order_relaxed);
+                if(p == x)  return x;
+                int gp = parent_[p].load(memory_order_relaxed);
+                if(gp != p) parent_[x].compare_exchange_weak(p, gp, memory_order_relaxed);     // path halving
+                x = gp;
+            }
+        }
+        // the larger root is linked under the smaller one, so concurrent unions cannot form a cycle
+        void unite(int a, int b)
+        {
+            while(true)
+            {
+                a = find(a);
+                b = find(b);
+                if(a == b)  return;
+                if(a < b)   swap(a, b);
+                int expected = a;
+                if(parent_[a].compare_exchange_strong(expected, b))
+                    return;
+            }
+        }
+        bool touching(int va, int vb, float sqr_tol) const
+        {
+            for(int i = voxel_start_[va]; i < voxel_start_[va + 1]; i++)
+            {
+                for(int j = voxel_start_[vb]; j < voxel_start_[vb + 1]; j++)
+                {
+                    float dx = px_[i] - px_[j], dy = py_[i] - py_[j], dz = pz_[i] - pz_[j];
+                    if(dx * dx + dy * dy + dz * dz <= sqr_tol)
+                        return true;
+                }
+            }
+            return false;
+        }
+
+    public:
+        VoxelClusterExtraction(){};
+        ~VoxelClusterExtraction(){};
+
+        void setClusterTolerance(double tolerance) { tolerance_ = tolerance; }
+        void setMinClusterSize(int n) { min_size_ = n; }
+        void setMaxClusterSize(int n) { max_size_ = n; }
+
+        template<typename PointT>
+        void extract(const pcl::PointCloud<PointT>& cloud, vector<pcl::PointIndices>& clusters, ThreadPool* pool = nullptr)
+        {
+            clusters.clear();
+            const int n = cloud.points.size();
+            if(n == 0 || tolerance_ <= 0)
+                return;
+            const double inv_leaf = sqrt(3.0) / tolerance_;
+            const float sqr_tol = tolerance_ * tolerance_;
+
+            // ------ bin ------
+            key2voxel_.clear();
+            key2voxel_.reserve(n);
+            voxel_keys_.clear();
+            point_voxel_.resize(n);
+            for(int i = 0; i < n; i++)
+            {
+                const PointT& p = cloud.points[i];
+                if(!isfinite(p.x) || !isfinite(p.y) || !isfinite(p.z))
+                {
+                    point_voxel_[i] = -1;
+                    continue;
+                }
+                VoxelKey key = getVoxelKey(p.x, p.y, p.z, inv_leaf);
+                auto res = key2voxel_.emplace(key, (int)voxel_keys_.size());
+                if(res.second)
+                    voxel_keys_.push_back(key);
+                point_voxel_[i] = res.first->second;
+            }
+            const int n_vox = voxel_keys_.size();
+            voxel_start_.assign(n_vox + 1, 0);
+            for(int i = 0; i < n; i++)
+            {
+                if(point_voxel_[i] >= 0)    voxel_start_[point_voxel_[i] + 1]++;
+            }
+            for(int v = 0; v < n_vox; v++)
+                voxel_start_[v + 1] += voxel_start_[v];
+            px_.resize(voxel_start_[n_vox]);
+            py_.resize(voxel_start_[n_vox]);
+            pz_.resize(voxel_start_[n_vox]);
+            {
+                vector<int> fill(voxel_start_.begin(), voxel_start_.end() - 1);
+                for(int i = 0; i < n; i++)
+                {
+                    int v = point_voxel_[i];
+                    if(v < 0)   continue;
+                    int k = fill[v]++;
+                    px_[k] = cloud.points[i].x;
+                    py_[k] = cloud.points[i].y;
+                    pz_[k] = cloud.points[i].z;
+                }
+            }
+
+            // ------ union-find over neighbouring voxels ------
+            if(parent_cap_ < (size_t)n_vox)
+            {
+                parent_cap_ = n_vox;
+                parent_.reset(new atomic<int>[parent_cap_]);
+            }
+            for(int v = 0; v < n_vox; v++)
+                parent_[v].store(v, memory_order_relaxed);
+
+            // half of the [-2, 2]^3 neighbourhood, every voxel pair is visited once
+            static const vector<VoxelKey> offsets = []()
+            {
+                vector<VoxelKey> o;
+                for(int dx = -2; dx <= 2; dx++)
+                    for(int dy = -2; dy <= 2; dy++)
+                        for(int dz = -2; dz <= 2; dz++)
+                        {
+                            if(dx > 0 || (dx == 0 && (dy > 0 || (dy == 0 && dz > 0))))
+                                o.push_back(VoxelKey{dx, dy, dz});
+                        }
+                return o;
+            }();
+            auto link_block = [&](int b, int n_blocks)
+            {
+                int v_begin = (long)n_vox * b / n_blocks, v_end = (long)n_vox * (b + 1) / n_blocks;
+                for(int v = v_begin; v < v_end; v++)
+                {
+                    const VoxelKey& k = voxel_keys_[v];
+                    for(const VoxelKey& o : offsets)
+                    {
+                        auto it = key2voxel_.find(VoxelKey{k.x + o.x, k.y + o.y, k.z + o.z});
+                        if(it == key2voxel_.end())  continue;
+                        int w = it->second;
+                        if(find(v) != find(w) && touching(v, w, sqr_tol))
+                            unite(v, w);
+                    }
+                }
+            };
+            if(pool && pool->size() > 1)
+            {
+                int n_blocks = min(n_vox, pool->size() * 8);
+                pool->parallelFor(n_blocks, [&](int b, int worker) { link_block(b, n_blocks); });
+            }
+            else
+                link_block(0, 1);
+
+            // ------ components -> clusters ------
+            root_size_.assign(n_vox, 0);
+            for(int v = 0; v < n_vox; v++)
+                root_size_[find(v)] += voxel_start_[v + 1] - voxel_start_[v];
+            root_cluster_.assign(n_vox, -1);
+            for(int i = 0; i < n; i++)      // in point order, so the indices come out ascending
+            {
+                if(point_voxel_[i] < 0)     continue;
+                int r = find(point_voxel_[i]);
+                if(root_size_[r] < min_size_ || root_size_[r] > max_size_)
+                    continue;
+                if(root_cluster_[r] < 0)
+                {
+                    root_cluster_[r] = clusters.size();
+                    clusters.push_back(pcl::PointIndices());
+                    clusters.back().header = cloud.header;
+                    clusters.back().indices.reserve(root_size_[r]);
+                }
+                clusters[root_cluster_[r]].indices.push_back(i);
+            }
+            stable_sort(clusters.begin(), clusters.end(), [](const pcl::PointIndices& a, const pcl::PointIndices& b)
+            {
+                return a.indices.size() > b.indices.size();
+            });
+        }
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef VoxelHash_H
+#define VoxelHash_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+
+using namespace std;
+
+// Integer voxel coordinate. Stored in full 64-bit so any scene extent can be binned without overflow.
+struct VoxelKey
+{
+    int64_t x, y, z;
+
+    bool operator==(const VoxelKey& other) const
+    {
+        return x == other.x && y == other.y && z == other.z;
+    }
+};
+
+// 64-bit spatial hash (prime mixing + splitmix64 finalizer) for VoxelKey.
+struct VoxelKeyHash
+{
+    size_t operator()(const VoxelKey& k) const
+    {
+        uint64_t h = (uint64_t)k.x * 0x9E3779B97F4A7C15ULL;
+        h ^= (uint64_t)k.y * 0xC2B2AE3D27D4EB4FULL + (h << 6) + (h >> 2);
+        h ^= (uint64_t)k.z * 0x165667B19E3779F9ULL + (h << 6) + (h >> 2);
+        h ^= h >> 31;
+        h *= 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 29;
+        return (size_t)h;
+    }
+};
+
+inline VoxelKey getVoxelKey(float x, float y, float z, float inv_leaf)
+{
+    // same binning rule as pcl::VoxelGrid: floor(p * inverse_leaf_size), in float as there, so that points on a
+    // leaf boundary fall in the same leaf
+    VoxelKey k;
+    k.x = (int64_t)floor(x * inv_leaf);
+    k.y = (int64_t)floor(y * inv_leaf);
+    k.z = (int64_t)floor(z * inv_leaf);
+    return k;
+}
+
+// Single-pass centroid-per-leaf voxel downsampler.
+// Unlike pcl::VoxelGrid it has no int32 index limit, so large scenes need not be split into blocks.
+class VoxelHashGrid
+{
+    private:
+        struct VoxelAcc
+        {
+            VoxelKey key;
+            double x, y, z, intensity;
+            int n;
+        };
+
+        double leaf_size_ = 0.01;
+        float inv_leaf_ = 100.0f;       // float, as pcl::VoxelGrid's inverse_leaf_size_
+        unordered_map<VoxelKey, int, VoxelKeyHash> key2slot_;
+        vector<VoxelAcc> voxels_;
+        vector<int> order_;
+
+    public:
+        VoxelHashGrid(){};
+        ~VoxelHashGrid(){};
+
+        // Drop all voxels but keep the allocated buckets for the next frame.
+        void reset(double leaf_size)
+        {
+            leaf_size_ = leaf_size;
+            inv_leaf_ = 1.0f / (float)leaf_size;
+            key2slot_.clear();
+            voxels_.clear();
+        }
+        void reserve(size_t n)
+        {
+            key2slot_.reserve(n);
+            voxels_.reserve(n);
+        }
+        size_t size() const { return voxels_.size(); }
+
+        inline int addPoint(float x, float y, float z, float intensity)
+        {
+            return addPoint(getVoxelKey(x, y, z, inv_leaf_), x, y, z, intensity);
+        }
+        inline int addPoint(const VoxelKey& key, float x, float y, float z, float intensity)
+        {
+            auto res = key2slot_.emplace(key, (int)voxels_.size());
+            if(res.second)
+            {
+                VoxelAcc acc;
+                acc.key = key;
+                acc.x = x;  acc.y = y;  acc.z = z;  acc.intensity = intensity;
+                acc.n = 1;
+                voxels_.push_back(acc);
+                return res.first->second;
+            }
+            VoxelAcc& acc = voxels_[res.first->second];
+            acc.x += x;  acc.y += y;  acc.z += z;  acc.intensity += intensity;
+            acc.n++;
+            return res.first->second;
+        }
+
+        // Write one centroid per occupied leaf.
+        // Leaves are emitted in pcl::VoxelGrid order (z, then y, then x), so the result has the same leaves in the same
+        // order as VoxelGrid; the centroids are summed in double and agree with VoxelGrid's float sums up to rounding.
+        template<typename CloudT>
+        void getCentroids(CloudT& cloud_out)
+        {
+            order_.resize(voxels_.size());
+            for(int i = 0; i < (int)order_.size(); i++)  order_[i] = i;
+            sort(order_.begin(), order_.end(), [this](int a, int b)
+            {
+                const VoxelKey& ka = voxels_[a].key;
+                const VoxelKey& kb = voxels_[b].key;
+                if(ka.z != kb.z)    return ka.z < kb.z;
+                if(ka.y != kb.y)    return ka.y < kb.y;
+                return ka.x < kb.x;
+            });
+
+            cloud_out.points.resize(voxels_.size());
+            for(size_t i = 0; i < order_.size(); i++)
+            {
+                const VoxelAcc& acc = voxels_[order_[i]];
+                double inv_n = 1.0 / acc.n;
+                cloud_out.points[i].x = acc.x * inv_n;
+                cloud_out.points[i].y = acc.y * inv_n;
+                cloud_out.points[i].z = acc.z * inv_n;
+                cloud_out.points[i].intensity = acc.intensity * inv_n;
+            }
+            cloud_out.width = cloud_out.points.size();
+            cloud_out.height = 1;
+            cloud_out.is_dense = true;
+        }
+};
+
+#endif
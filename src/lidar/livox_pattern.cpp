@@ -34,6 +34,7 @@
 
 #include <lvt2calib/ClusterCentroids.h>
 #include <lvt2calib/AutoDetectLaser.h>
+#include <lvt2calib/BackgroundModel.h>
 #include <lvt2calib/FourCircleCenters.h>
 #include <lvt2calib/livox_utils.h>
 #include <lvt2calib/LaserConfig.h>
@@ -48,13 +49,17 @@ using namespace Eigen;
 typedef pcl::PointXYZI PointType;
 typedef pcl::PointCloud<PointType> CloudType;
 
-int queue_size_ = 1;
+int queue_size_ = 1, num_threads_ = 4, plane_seg_history_ = 1, regist_polish_iter_ = 0, background_frames_ = 0;
 bool pos_changed_ = false;
 
 bool use_RG_Pseg = false;
 bool use_vox_filter_ = true, use_i_filter_ = true,
      use_gauss_filter_, auto_mode_ = true, use_statistic_filter_,
-     is_gazebo = false, use_gauss_filter2_;
+     is_gazebo = false, use_gauss_filter2_, use_fused_prefilter_ = true, debug_clouds_ = false, use_planar_regist_ = true,
+     use_pca_hypotheses_ = true, verify_early_abort_ = true, use_normal_cache_ = true, use_grid_boundary_ = true, use_voxel_cluster_ = true,
+     use_adaptive_ransac_ = true, use_planarity_check_ = true, use_tracking_ = true,
+     use_template_centers_ = true, refine_template_centers_ = false, use_hough_circles_ = true,
+     use_pattern_fit_ = true;
 double re, reforn, Pseg_size_min_,
         remove_x_min_, remove_x_max_,
         cluster_tole_, cluster_size_min_, cluster_size_max_, 
@@ -66,11 +71,12 @@ double re, reforn, Pseg_size_min_,
         RG_smooth_thre_deg_, RG_curve_thre_;
 double gauss_k_sigma_, gauss_k_thre_rt_sigma_, gauss_k_thre_,
         gauss_conv_radius_;
+double tracking_margin_ = 0.3, background_leaf_ = 0.1, grid_boundary_cell_ = 0.0, circle_spacing_ = 0.3;
 double gauss_k_sigma2_, gauss_k_thre_rt_sigma2_, gauss_k_thre2_,
         gauss_conv_radius2_;
 int Pseg_iter_num_, min_centers_found_, max_acc_frame_ = 0, 
     sor_MeanK_, sor_StddevMulThresh_, RG_neighbor_n_;
-std::string model_path = "";
+std::string model_path = "", background_file_ = "";
 
 double Rad_to_deg = 45.0 / atan(1.0), 
         max_size = 120 * 80;
@@ -89,6 +95,7 @@ ros::Publisher colored_planes_pub;
 string ns_str;
 
 AutoDetectLaser myDetector;
+BackgroundModel background_;
 FourCircleCenters myFourCenters;
 
 void load_param(ros::NodeHandle& nh_);
@@ -118,6 +125,7 @@ void callback(const PointCloud2::ConstPtr& laser_cloud)
     
     if(pos_changed_)
     {
+        myDetector.resetTracking();    // the board has been moved
         if(clouds_proc_ <= queue_size_)
             return;
         else
@@ -126,8 +134,35 @@ void callback(const PointCloud2::ConstPtr& laser_cloud)
             // ROS_WARN("****** queue clear, clouds_proc_ = %d ******", clouds_proc_);
         }
     }
+
+    // ****** static background: learnt from the first frames of the empty scene, then subtracted ******
+    if(background_frames_ > 0)
+    {
+        if(background_.frames() < background_frames_)
+        {
+            background_.learn(*cloud_in);
+            ROS_INFO("[%s] Background frame %d/%d: %d voxels", ns_str.c_str(), background_.frames(), background_frames_, (int)background_.size());
+            if(background_.frames() == background_frames_ && !background_file_.empty())
+            {
+                if(background_.save(background_file_))
+                    ROS_INFO("[%s] Background saved to %s", ns_str.c_str(), background_file_.c_str());
+                else
+                    ROS_WARN("[%s] Cannot save the background to %s", ns_str.c_str(), background_file_.c_str());
+            }
+            return;
+        }
+        pcl::PointCloud<pcl::PointXYZI>::Ptr foreground (new pcl::PointCloud<pcl::PointXYZI>);
+        background_.subtract(*cloud_in, *foreground);
+        if(DEBUG) cout << "[" << ns_str << "] " << foreground->points.size() << " of " << cloud_in->points.size() << " points outside the background" << endl;
+        cloud_in.swap(foreground);
+    }
     
     pcl::PointCloud<pcl::PointXYZRGB>::Ptr colored_planes(new pcl::PointCloud<pcl::PointXYZRGB>);
+    // only keep the intermediate clouds somebody is going to look at
+    unsigned int capture_mask = debug_clouds_ ? CAPTURE_ALL : CAPTURE_NONE;
+    if(plane_segments_pub.getNumSubscribers() > 0)
+        capture_mask |= CAPTURE_PLANE_SEGMENTS;
+    myDetector.setCaptureMask(capture_mask);
     bool ifDetected = false;
     if(!use_RG_Pseg)
     {
@@ -157,7 +192,10 @@ void callback(const PointCloud2::ConstPtr& laser_cloud)
             if (if_use_single_board)
             {
                 // use single frame board to extract circle centers
-                find_centers = myFourCenters.FindFourCenters(calib_board_bound_template, four_circle_centers, myDetector.Tr_calib2tpl_.inverse());
+                if(use_template_centers_)
+                    find_centers = myFourCenters.FindTemplateCenters(calib_board_bound_template, four_circle_centers, myDetector.Tr_calib2tpl_.inverse(), myDetector.calib_board_boundary_);
+                else
+                    find_centers = myFourCenters.FindFourCenters(calib_board_bound_template, four_circle_centers, myDetector.Tr_calib2tpl_.inverse());
             }
             else
             {
@@ -237,7 +275,10 @@ void callback(const PointCloud2::ConstPtr& laser_cloud)
                     acc_boards_bound_registed_ros.header = laser_cloud->header;
                     acc_boards_bound_registed_pub.publish(acc_boards_bound_registed_ros); // topic: /livox_pattern/acc_boards_bound_registed
 
-                    find_centers = myFourCenters.FindFourCenters(calib_board_bound_template, four_circle_centers, Tr_calib2tpl.inverse());
+                    if(use_template_centers_)
+                        find_centers = myFourCenters.FindTemplateCenters(calib_board_bound_template, four_circle_centers, Tr_calib2tpl.inverse(), acc_calib_boundary);
+                    else
+                        find_centers = myFourCenters.FindFourCenters(calib_board_bound_template, four_circle_centers, Tr_calib2tpl.inverse());
                     // bool find_centers = myFourCenters.FindFourCenters(acc_calib_boundary, four_circle_centers, Eigen::Matrix4f::Identity());
                 }
             }
@@ -377,10 +418,34 @@ void load_param(ros::NodeHandle& nh_)
     nh_.param("use_gauss_filter", use_gauss_filter_, true);
     nh_.param("use_gauss_filter2", use_gauss_filter2_, true);
     nh_.param("use_statistic_filter", use_statistic_filter_, false);
+    nh_.param("use_fused_prefilter", use_fused_prefilter_, true);
+    nh_.param("debug_clouds", debug_clouds_, false);
+    nh_.param("use_planar_regist", use_planar_regist_, true);
+    nh_.param("regist_polish_iter", regist_polish_iter_, 0);
+    nh_.param("use_pca_hypotheses", use_pca_hypotheses_, true);
+    nh_.param("verify_early_abort", verify_early_abort_, true);
+    nh_.param("use_normal_cache", use_normal_cache_, true);
+    nh_.param("use_grid_boundary", use_grid_boundary_, true);
+    nh_.param("grid_boundary_cell", grid_boundary_cell_, 0.0);
+    nh_.param("use_voxel_cluster", use_voxel_cluster_, true);
+    nh_.param("use_adaptive_ransac", use_adaptive_ransac_, true);
+    nh_.param("use_planarity_check", use_planarity_check_, true);
+    nh_.param("use_tracking", use_tracking_, true);
+    nh_.param("tracking_margin", tracking_margin_, 0.3);
+    nh_.param("background_frames", background_frames_, 0);
+    nh_.param("background_leaf", background_leaf_, 0.1);
+    nh_.param<std::string>("background_file", background_file_, "");
     nh_.param("use_RG_Pseg", use_RG_Pseg, false);
     nh_.param("queue_size", queue_size_, 1);
+    nh_.param("num_threads", num_threads_, 4);
+    nh_.param("plane_seg_history", plane_seg_history_, 1);
     nh_.param<std::string>("ns", ns_str, "laser");
     nh_.param("if_use_single_board", if_use_single_board, false);
+    nh_.param("use_template_centers", use_template_centers_, true);
+    nh_.param("refine_template_centers", refine_template_centers_, false);
+    nh_.param("use_hough_circles", use_hough_circles_, true);
+    nh_.param("use_pattern_fit", use_pattern_fit_, true);
+    nh_.param("circle_spacing", circle_spacing_, 0.3);
 
     return;
 }
@@ -402,6 +467,20 @@ void set_run_param()
     myDetector.setRGPlaneSegmentationParam(RG_smooth_thre_deg_, RG_curve_thre_, RG_neighbor_n_);
     myDetector.useIntensityFilter(use_i_filter_);
     myDetector.setIntensityFilterParam(i_filter_out_min_, i_filter_out_max_);
+    myDetector.useFusedPrefilter(use_fused_prefilter_);
+    myDetector.setNumThreads(num_threads_);
+    myDetector.setPlaneSegmentHistory(plane_seg_history_);
+    myDetector.setRegistrationMethod(use_planar_regist_ ? REGIST_PLANAR : REGIST_ICP, regist_polish_iter_);
+    myDetector.usePCAHypotheses(use_pca_hypotheses_);
+    myDetector.useVerifyEarlyAbort(verify_early_abort_);
+    myDetector.useNormalCache(use_normal_cache_);
+    myDetector.useGridBoundary(use_grid_boundary_);
+    myDetector.setGridBoundaryParam(grid_boundary_cell_, 0.5);
+    myDetector.setClusterMethod(use_voxel_cluster_ ? CLUSTER_VOXEL : CLUSTER_KDTREE);
+    myDetector.useAdaptiveRansac(use_adaptive_ransac_);
+    myDetector.usePlanarityCheck(use_planarity_check_);
+    myDetector.useTracking(use_tracking_);
+    myDetector.setTrackingMargin(tracking_margin_);
 
     myDetector.setBoundEstKSearch(re);
     myDetector.setNormEstKSearch(reforn);
@@ -412,6 +491,10 @@ void set_run_param()
     myFourCenters.setCircleRadius(circle_radius_);
     myFourCenters.setCentroidDis(centroid_dis_min_, centroid_dis_max_);
     myFourCenters.setMinNumCentersFound(min_centers_found_);
+    myFourCenters.useCenterRefinement(refine_template_centers_);
+    myFourCenters.useHough(use_hough_circles_);
+    myFourCenters.usePatternFit(use_pattern_fit_);
+    myFourCenters.setCircleSpacing(circle_spacing_);
 }
 
 
@@ -424,6 +507,12 @@ int main(int argc, char **argv)
 
     // ***************** load param
     load_param(nh_);
+    background_.setLeafSize(background_leaf_);
+    if(background_frames_ > 0 && !background_file_.empty() && background_.load(background_file_))
+    {
+        ROS_INFO("[%s] Background loaded from %s: %d voxels", ns_str.c_str(), background_file_.c_str(), (int)background_.size());
+        background_frames_ = background_.frames();
+    }
     // set_run_param();
 
 	ostringstream os;
@@ -33,6 +33,8 @@
 #include <thread>
 
 #include <lvt2calib/AutoDetectLaser.h>
+#include <lvt2calib/BackgroundModel.h>
+#include <lvt2calib/RingRangeImage.h>
 #include <lvt2calib/FourCircleCenters.h>
 #include <lvt2calib/velo_utils.h>
 #include <lvt2calib/LaserConfig.h>
@@ -48,13 +50,17 @@ typedef Velodyne::Point PointType;
 typedef pcl::PointCloud<PointType> CloudType;
 int laser_ring_num = 16;
 
-int queue_size_ = 1;
+int queue_size_ = 1, num_threads_ = 4, plane_seg_history_ = 1, regist_polish_iter_ = 0, background_frames_ = 0,
+    range_image_cols_ = 1800;
 bool pos_changed_ = false;
 
 bool use_RG_Pseg = false;
 bool use_vox_filter_ = true, use_i_filter_ = true,
      use_gauss_filter_, auto_mode_ = true, use_statistic_filter_,
-     is_gazebo = false, use_gauss_filter2_;
+     is_gazebo = false, use_gauss_filter2_, use_fused_prefilter_ = true, debug_clouds_ = false, use_planar_regist_ = true,
+     use_pca_hypotheses_ = true, verify_early_abort_ = true, use_normal_cache_ = true, use_grid_boundary_ = true, use_voxel_cluster_ = true,
+     use_adaptive_ransac_ = true, use_planarity_check_ = true, use_tracking_ = true,
+     use_range_image_ = false;
 double re, reforn, Pseg_size_min_,
         remove_x_min_, remove_x_max_,
         cluster_tole_, cluster_size_min_, cluster_size_max_, 
@@ -66,11 +72,12 @@ double re, reforn, Pseg_size_min_,
         RG_smooth_thre_deg_, RG_curve_thre_;
 double gauss_k_sigma_, gauss_k_thre_rt_sigma_, gauss_k_thre_,
         gauss_conv_radius_;
+double tracking_margin_ = 0.3, background_leaf_ = 0.1, grid_boundary_cell_ = 0.0, range_image_thre_ = 0.2;
 double gauss_k_sigma2_, gauss_k_thre_rt_sigma2_, gauss_k_thre2_,
         gauss_conv_radius2_;
 int Pseg_iter_num_, min_centers_found_, max_acc_frame_ = 0, 
     sor_MeanK_, sor_StddevMulThresh_, RG_neighbor_n_;
-std::string model_path = "";
+std::string model_path = "", background_file_ = "";
 
 double Rad_to_deg = 45.0 / atan(1.0), 
         max_size = 120 * 80;
@@ -87,6 +94,8 @@ ros::Publisher reload_cloud_pub, calib_board_pub;
 ros::Publisher cloud_in_pub, colored_i_planes_pub, icp_regist_boundary_pub, template_pc_pub, raw_boundary_pub, colored_planes_pub;
 
 AutoDetectLaser myDetector(R_LIDAR);
+BackgroundModel background_;
+RingRangeImage range_image_;
 FourCircleCenters myFourCenters;
 
 void load_param(ros::NodeHandle& nh_);
@@ -116,6 +125,7 @@ void callback(const PointCloud2::ConstPtr& laser_cloud)
 
     if (pos_changed_)
     {
+        myDetector.resetTracking();    // the board has been moved
         if(clouds_proc_ <= queue_size_)
             return;
         else
@@ -125,15 +135,61 @@ void callback(const PointCloud2::ConstPtr& laser_cloud)
         }
     }
 
+    // the organized path keeps the frame layout: built from the ring cloud, it indexes cloud_in_copy as well
+    bool organized = use_range_image_;
+    if(organized)
+        range_image_.build(*cloud_in, laser_ring_num, range_image_cols_);
+
+    // ****** static background: learnt from the first frames of the empty scene, then subtracted ******
+    if(background_frames_ > 0)
+    {
+        if(background_.frames() < background_frames_)
+        {
+            background_.learn(*cloud_in_copy);
+            ROS_INFO("[%s] Background frame %d/%d: %d voxels", ns_str.c_str(), background_.frames(), background_frames_, (int)background_.size());
+            if(background_.frames() == background_frames_ && !background_file_.empty())
+            {
+                if(background_.save(background_file_))
+                    ROS_INFO("[%s] Background saved to %s", ns_str.c_str(), background_file_.c_str());
+                else
+                    ROS_WARN("[%s] Cannot save the background to %s", ns_str.c_str(), background_file_.c_str());
+            }
+            return;
+        }
+        if(organized)
+        {
+            range_image_.removePoints([&](int i) { return background_.isBackground(cloud_in_copy->points[i]); });
+        }
+        else
+        {
+            pcl::PointCloud<pcl::PointXYZI>::Ptr foreground (new pcl::PointCloud<pcl::PointXYZI>);
+            background_.subtract(*cloud_in_copy, *foreground);
+            if(DEBUG) cout << "[" << ns_str << "] " << foreground->points.size() << " of " << cloud_in_copy->points.size() << " points outside the background" << endl;
+            cloud_in_copy.swap(foreground);
+        }
+    }
+
+    // only keep the intermediate clouds somebody is going to look at
+    unsigned int capture_mask = debug_clouds_ ? CAPTURE_ALL : CAPTURE_NONE;
+    if(colored_i_planes_pub.getNumSubscribers() > 0)
+        capture_mask |= CAPTURE_PLANE_SEGMENTS;
+    myDetector.setCaptureMask(capture_mask);
+
 	bool ifDetected = false;
     if(!use_RG_Pseg)
     {
-        ifDetected = myDetector.detectCalibBoard(cloud_in_copy, calib_board);
+        if(organized)
+            ifDetected = myDetector.detectCalibBoard(cloud_in_copy, range_image_, calib_board);
+        else
+            ifDetected = myDetector.detectCalibBoard(cloud_in_copy, calib_board);
         publishPC<pcl::PointXYZI>(colored_i_planes_pub, cloud_header, myDetector.colored_i_planes_);
     }    
     else
     {
-        ifDetected = myDetector.detectCalibBoardRG(cloud_in_copy, calib_board);
+        if(organized)
+            ifDetected = myDetector.detectCalibBoardRG(cloud_in_copy, range_image_, calib_board);
+        else
+            ifDetected = myDetector.detectCalibBoardRG(cloud_in_copy, calib_board);
         publishPC<pcl::PointXYZRGB>(colored_planes_pub, cloud_header, myDetector.colored_planes_);
     }
 
@@ -257,8 +313,30 @@ void load_param(ros::NodeHandle& nh_)
     nh_.param("use_gauss_filter", use_gauss_filter_, true);
     nh_.param("use_gauss_filter2", use_gauss_filter2_, true);
     nh_.param("use_statistic_filter", use_statistic_filter_, false);
+    nh_.param("use_fused_prefilter", use_fused_prefilter_, true);
+    nh_.param("debug_clouds", debug_clouds_, false);
+    nh_.param("use_planar_regist", use_planar_regist_, true);
+    nh_.param("regist_polish_iter", regist_polish_iter_, 0);
+    nh_.param("use_pca_hypotheses", use_pca_hypotheses_, true);
+    nh_.param("verify_early_abort", verify_early_abort_, true);
+    nh_.param("use_normal_cache", use_normal_cache_, true);
+    nh_.param("use_grid_boundary", use_grid_boundary_, true);
+    nh_.param("grid_boundary_cell", grid_boundary_cell_, 0.0);
+    nh_.param("use_voxel_cluster", use_voxel_cluster_, true);
+    nh_.param("use_adaptive_ransac", use_adaptive_ransac_, true);
+    nh_.param("use_planarity_check", use_planarity_check_, true);
+    nh_.param("use_tracking", use_tracking_, true);
+    nh_.param("tracking_margin", tracking_margin_, 0.3);
+    nh_.param("background_frames", background_frames_, 0);
+    nh_.param("background_leaf", background_leaf_, 0.1);
+    nh_.param<std::string>("background_file", background_file_, "");
+    nh_.param("use_range_image", use_range_image_, false);
+    nh_.param("range_image_cols", range_image_cols_, 1800);
+    nh_.param("range_image_thre", range_image_thre_, 0.2);
     nh_.param("use_RG_Pseg", use_RG_Pseg, false);
     nh_.param("queue_size", queue_size_, 1);
+    nh_.param("num_threads", num_threads_, 4);
+    nh_.param("plane_seg_history", plane_seg_history_, 1);
     nh_.param<std::string>("ns", ns_str, "laser");
 
     return;
@@ -281,6 +359,21 @@ void set_run_param()
     myDetector.setRGPlaneSegmentationParam(RG_smooth_thre_deg_, RG_curve_thre_, RG_neighbor_n_);
     myDetector.useIntensityFilter(use_i_filter_);
     myDetector.setIntensityFilterParam(i_filter_out_min_, i_filter_out_max_);
+    myDetector.useFusedPrefilter(use_fused_prefilter_);
+    myDetector.setNumThreads(num_threads_);
+    myDetector.setPlaneSegmentHistory(plane_seg_history_);
+    myDetector.setRegistrationMethod(use_planar_regist_ ? REGIST_PLANAR : REGIST_ICP, regist_polish_iter_);
+    myDetector.usePCAHypotheses(use_pca_hypotheses_);
+    myDetector.useVerifyEarlyAbort(verify_early_abort_);
+    myDetector.useNormalCache(use_normal_cache_);
+    myDetector.useGridBoundary(use_grid_boundary_);
+    myDetector.setGridBoundaryParam(grid_boundary_cell_, 0.5);
+    myDetector.setClusterMethod(use_voxel_cluster_ ? CLUSTER_VOXEL : CLUSTER_KDTREE);
+    myDetector.useAdaptiveRansac(use_adaptive_ransac_);
+    myDetector.usePlanarityCheck(use_planarity_check_);
+    myDetector.useTracking(use_tracking_);
+    myDetector.setTrackingMargin(tracking_margin_);
+    myDetector.setRangeImageClusterParam(range_image_thre_, 2);
 
     myDetector.setBoundEstKSearch(re);
     myDetector.setNormEstKSearch(reforn);
@@ -304,6 +397,12 @@ int main(int argc, char **argv)
 
     // ***************** load param
     load_param(nh_);
+    background_.setLeafSize(background_leaf_);
+    if(background_frames_ > 0 && !background_file_.empty() && background_.load(background_file_))
+    {
+        ROS_INFO("[%s] Background loaded from %s: %d voxels", ns_str.c_str(), background_file_.c_str(), (int)background_.size());
+        background_frames_ = background_.frames();
+    }
     // set_run_param();
 
 	ostringstream os;
@@ -54,6 +54,7 @@
 #include <lvt2calib/VeloCircleConfig.h>
 #include <lvt2calib/velo_utils.h>
 #include <lvt2calib/ClusterCentroids.h>
+#include <lvt2calib/CircleDetection.h>
 
 using namespace std;
 using namespace sensor_msgs;
@@ -76,6 +77,9 @@ double cluster_size_;
 double edge_depth_thre_, edge_knn_radius_;
 int clouds_proc_ = 0, clouds_used_ = 0;
 int min_centers_found_;
+double circle_seg_dis_thre_ = 0.04;   // inlier distance of the circle fits
+bool use_hough_ = true, use_pattern_fit_ = true;
+double circle_spacing_ = 0.3;
 int rings_count;
 
 string ns_str;
@@ -284,7 +288,7 @@ void callback(const PointCloud2::ConstPtr& laser_cloud, const PointCloud2::Const
   // Ransac settings for circle detection
   pcl::SACSegmentation<pcl::PointXYZ> circle_segmentation;
   circle_segmentation.setModelType (pcl::SACMODEL_CIRCLE2D);
-  circle_segmentation.setDistanceThreshold (0.04);
+  circle_segmentation.setDistanceThreshold (circle_seg_dis_thre_);
   circle_segmentation.setMethodType (pcl::SAC_RANSAC);
   circle_segmentation.setOptimizeCoefficients (true);
   circle_segmentation.setMaxIterations(1000);
@@ -304,10 +308,19 @@ void callback(const PointCloud2::ConstPtr& laser_cloud, const PointCloud2::Const
   pcl::ExtractIndices<pcl::PointXYZ> extract;
 
   std::vector< std::vector<float> > found_centers;
-  std::vector<pcl::PointXYZ> centroid_cloud_inliers;
+  CirclePointHash centroid_cloud_inliers;   // circle points set aside near the centroid
+  centroid_cloud_inliers.setCellSize(circle_radius_ + 0.02);
   bool valid = true;   // if it is a valid center 
 
-  while ((copy_cloud->points.size()+centroid_cloud_inliers.size()) > 3 && found_centers.size()<4 && copy_cloud->points.size()){
+  if(use_hough_){
+    // all circles in one pass of a fixed-radius Hough accumulator
+    HoughCircleDetector hough;
+    findPatternCirclesHough(hough, *copy_cloud, Eigen::Vector2f(edges_centroid.x, edges_centroid.y), circle_radius_, circle_seg_dis_thre_,
+                            centroid_distance_min_, centroid_distance_max_, zcoord_xyplane, found_centers);
+  }
+
+  // RANSAC: one circle at a time, its inliers are removed before the next one
+  while (!use_hough_ && (copy_cloud->points.size()+centroid_cloud_inliers.size()) > 3 && found_centers.size()<4 && copy_cloud->points.size()){
     circle_segmentation.setInputCloud (copy_cloud);
     circle_segmentation.segment (*inliers3, *coefficients3);
     if (inliers3->indices.size () == 0)
@@ -338,7 +351,7 @@ void callback(const PointCloud2::ConstPtr& laser_cloud, const PointCloud2::Const
       valid = false;
       // ???
       for (pcl::PointCloud<pcl::PointXYZ>::iterator pt = circle_cloud->points.begin(); pt < circle_cloud->points.end(); ++pt){
-        centroid_cloud_inliers.push_back(*pt);
+        centroid_cloud_inliers.insert(*pt);
       }
     }else if(centroid_distance > centroid_distance_max_){
       valid = false;
@@ -352,18 +365,9 @@ void callback(const PointCloud2::ConstPtr& laser_cloud, const PointCloud2::Const
         }
       }
 
-      // If center is valid, check if any point from wrong_circle belongs to it, and pop it if true
-      for (std::vector<pcl::PointXYZ>::iterator pt = centroid_cloud_inliers.begin(); pt < centroid_cloud_inliers.end(); ++pt){
-        if(DEBUG) cout << "In schrodinger_pt" << endl;
-        pcl::PointXYZ schrodinger_pt((*pt).x, (*pt).y, (*pt).z);
-        double distance_to_cluster = sqrt(pow(schrodinger_pt.x-center.x,2) + pow(schrodinger_pt.y-center.y,2) + pow(schrodinger_pt.z-center.z,2));
-        // ROS_DEBUG("Distance to cluster: %lf", distance_to_cluster);
-        if(distance_to_cluster<circle_radius_+0.02){
-          centroid_cloud_inliers.erase(pt);
-          --pt; // To avoid out of range
-        }
-      }
-      // ROS_DEBUG("Remaining inliers %lu", centroid_cloud_inliers.size());
+      // If center is valid, the points set aside that belong to its circle are dropped
+      int removed = centroid_cloud_inliers.removeRadius(center.x, center.y, center.z, circle_radius_ + 0.02);
+      ROS_DEBUG("%d points set aside belong to this circle, %lu left", removed, centroid_cloud_inliers.size());
     }
 
     if (valid){
@@ -385,6 +389,18 @@ void callback(const PointCloud2::ConstPtr& laser_cloud, const PointCloud2::Const
     ROS_DEBUG("Remaining points in cloud %lu", copy_cloud->points.size());
   }
 
+  if(use_pattern_fit_ && found_centers.size() >= 2){
+    // the circles found seed a rigid fit of the whole pattern to all circle points
+    CirclePatternFit pattern_fit;
+    if(fitCirclePattern(pattern_fit, *xy_cloud, circle_radius_, circle_seg_dis_thre_, circle_spacing_, zcoord_xyplane, found_centers)){
+      for (size_t k = 0; k < found_centers.size(); k++){
+        ROS_DEBUG("Pattern fit center %f %f: %d points, sd %f", found_centers[k][0], found_centers[k][1], pattern_fit.support(k), sqrt(pattern_fit.centerCovariance(k).trace()));
+      }
+    }else{
+      ROS_DEBUG("Pattern fit rejected, %d circles seen", pattern_fit.supportedCircles());
+    }
+  }
+
   pcl::PointCloud<pcl::PointXYZ>::Ptr circle_center_cloud(new pcl::PointCloud<pcl::PointXYZ>);   // One frame of centers
 
   if(found_centers.size() >= min_centers_found_ && found_centers.size() < 5){
@@ -499,6 +515,9 @@ int main(int argc, char **argv){
 
   nh_.param("cluster_size", cluster_size_, 0.02);
   nh_.param("min_centers_found", min_centers_found_, 4);
+  nh_.param("use_hough_circles", use_hough_, true);
+  nh_.param("use_pattern_fit", use_pattern_fit_, true);
+  nh_.param("circle_spacing", circle_spacing_, 0.3);
   nh_.param<std::string>("ns", ns_str, "laser");
   nh_.param("laser_ring_num", rings_count, 16);
   findLaserType(rings_count);